@@ -24,10 +24,10 @@
 
 using namespace std;
 
-ContModel* cont_model;
-
+/* the dnest callbacks get the continuum model through arg */
 double prob_cont(const void *model, const void *arg)
 {
+  ContModel *cont_model = (ContModel *)arg;
   double prob = 0.0;
   int i, info;
   double *pm = (double *)model;
@@ -91,6 +91,7 @@ double prob_cont(const void *model, const void *arg)
 
 void from_prior_cont(void *model, const void *arg)
 {
+  ContModel *cont_model = (ContModel *)arg;
   int i;
   double *pm = (double *)model;
 
@@ -116,6 +117,7 @@ void from_prior_cont(void *model, const void *arg)
 
 void print_particle_cont(FILE *fp, const void *model, const void *arg)
 {
+  ContModel *cont_model = (ContModel *)arg;
   int i;
   double *pm = (double *)model;
 
@@ -128,6 +130,7 @@ void print_particle_cont(FILE *fp, const void *model, const void *arg)
 
 double perturb_cont(void *model, const void *arg)
 {
+  ContModel *cont_model = (ContModel *)arg;
   double *pm = (double *)model;
   double logH = 0.0, limit1, limit2, width, rnd;
   int which, which_level;
@@ -330,7 +333,7 @@ void ContModel::mcmc()
   strcpy(argv[argc], "./");
   strcat(argv[argc++], "/data/restart_dnest.txt");
 
-  logz_con = dnest(argc, argv, fptrset, num_params, "data/", 1000, 0.1, NULL);
+  logz_con = dnest(argc, argv, fptrset, num_params, "data/", 1000, 0.1, this);
 
   for(i=0; i<9; i++)
   {
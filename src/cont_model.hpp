@@ -75,5 +75,4 @@ class ContModel
     DNestFptrSet *fptrset;
 };
 
-extern ContModel* cont_model;
 #endif
\ No newline at end of file
@@ -16,14 +16,15 @@ PixonDRW::PixonDRW()
   workspace_uv = NULL;
   Larr_data = NULL;
   USmat = NULL;
+  hv_cont = NULL;
 }
 
 PixonDRW::PixonDRW(
-   Data& cont_data_in, Data& cont_in, Data& line_data_in, 
+   const PixonContext& ctx_in, Data& cont_data_in, Data& cont_in, Data& line_data_in, 
    int npixel_in,  int npixon_size_max_in, double sigmad_in, double taud_in, double syserr_in,
-   int ipositive_in, double sensitivity_in
+   int ipositive_in, double sensitivity_in, bool adjoint_grad_in
   )
-  :Pixon(cont_in, line_data_in, npixel_in, npixon_size_max_in, ipositive_in, sensitivity_in),
+  :Pixon(ctx_in, cont_in, line_data_in, npixel_in, npixon_size_max_in, ipositive_in, sensitivity_in, adjoint_grad_in),
    cont_data(cont_data_in),
    sigmad(sigmad_in), taud(taud_in), syserr(syserr_in)
 {
@@ -31,49 +32,49 @@ PixonDRW::PixonDRW(
 
   nq = 1;
   size_max = fmax(cont.size, cont_data.size);
-  workspace = new double[size_max*15];
-  workspace_uv = new double[2*cont.size];
-  Larr_data = new double[cont_data.size*nq];
+  /* buffers of continuum reconstruction in one arena */
+  arena_drw.add(&workspace, size_max*15);
+  arena_drw.add(&workspace_uv, 2*cont.size);
+  arena_drw.add(&Larr_data, cont_data.size*nq);
+  arena_drw.add(&USmat, cont_data.size * cont.size);
+  arena_drw.add(&PQmat, cont.size * cont.size);
+  arena_drw.add(&D_data, cont_data.size);
+  arena_drw.add(&W_data, cont_data.size);
+  arena_drw.add(&phi_data, cont_data.size);
+  arena_drw.add(&Cq, nq*nq);
+  arena_drw.add(&QLmat, nq*cont.size);
+  arena_drw.add(&qhat, nq);
+  arena_drw.add(&D_recon, cont.size);
+  arena_drw.add(&W_recon, cont.size);
+  arena_drw.add(&phi_recon, cont.size);
+  arena_drw.add(&grad_chisq_cont, cont_in.size+nq);
+  arena_drw.add(&hv_cont, cont_in.size);
+  arena_drw.allocate();
+
   for(i=0; i<cont_data.size; i++)
   {
     Larr_data[i*nq+0] = 1.0;
   }
-  USmat = new double [cont_data.size * cont.size];
-  PQmat = new double [cont.size * cont.size];
-  D_data = new double[cont_data.size];
-  W_data = new double[cont_data.size];
-  phi_data = new double[cont_data.size];
-  Cq = new double[nq*nq];
-  QLmat = new double[nq*cont.size];
-  qhat = new double[nq];
-  D_recon = new double[cont.size];
-  W_recon = new double[cont.size];
-  phi_recon = new double[cont.size];
-
-  grad_chisq_cont = new double[cont_in.size+nq];
+
+  /* interpolation of image at line epochs shifted by each continuum time */
+  double *tau = new double[npixel];
+  for(i=0; i<npixel; i++)
+  {
+    tau[i] = (i - ipositive) * dt;
+  }
+  interp_image_op.set_lag(tau, npixel, dt, line.time, line.size, cont.time, cont.size, true);
+  delete[] tau;
 
   compute_matrix();
   //compute_matrix2();
+
+  /* rmline also depends on continuum parameters */
+  nx_rm = npixel+1+cont.size+nq;
 }
 
 PixonDRW::~PixonDRW()
 {
-  int i;
-  delete[] grad_chisq_cont;
-
-  delete[] workspace;
-  delete[] workspace_uv;
-  delete[] Larr_data;
-  delete[] USmat;
-  delete[] D_data;
-  delete[] W_data;
-  delete[] phi_data;
-  delete[] Cq;
-  delete[] QLmat;
-  delete[] qhat;
-  delete[] D_recon;
-  delete[] W_recon;
-  delete[] phi_recon;
+  /* buffers are freed with the arena */
 }
 
 /* compute rm amd pixon convolutions */
@@ -84,6 +85,27 @@ void PixonDRW::compute_rm_pixon(const double *x)
   Pixon::compute_rm_pixon(x);
 }
 
+/* 
+ * evaluate the objective, posterior plus entropy, at x and its gradient if wanted.
+ * a repeated evaluation at the last x returns at once.
+ */
+double PixonDRW::evaluate(const double *x, bool want_grad)
+{
+  double f;
+  if(eval_cached(x, npixel+1+cont.size+nq, want_grad))
+    return f_eval;
+
+  compute_rm_pixon(x);
+  f = compute_post(x) + compute_mem(x);
+  if(want_grad)
+  {
+    compute_post_grad(x);
+    compute_mem_grad(x);
+  }
+  eval_store(x, npixel+1+cont.size+nq, want_grad, f);
+  return f;
+}
+
 double PixonDRW::compute_chisquare(const double *x)
 {
   /* calculate chi square */
@@ -116,19 +138,15 @@ void PixonDRW::compute_post_grad(const double *x)
   /* derivative of chisq_line with respect to continuum */
   int i, j;
   double *res_mat = workspace;
-  double grad_in, tj, ti, Iintp;
   
+  for(j=0; j<line.size; j++)
+  {
+    resid_weight[j] = residual[j]/line.error[j]/line.error[j];
+  }
+  interp_image_op.correlate(image, resid_weight, res_mat);
   for(i=0; i<cont.size; i++)
   {
-    ti = cont.time[i];
-    grad_in = 0.0;
-    for(j=0; j<line.size; j++)
-    {
-      tj = line.time[j];
-      Iintp = interp_image(tj - ti);
-      grad_in += residual[j]/line.error[j]/line.error[j] * Iintp;
-    }
-    res_mat[i] = grad_in *  2.0;
+    res_mat[i] *= 2.0;
   }
   // w.r.t uq
   multiply_mat_MN(QLmat, res_mat, grad_chisq_cont, nq, 1, cont.size);
@@ -153,6 +171,65 @@ void PixonDRW::compute_mem_grad(const double *x)
   Pixon::compute_mem_grad(x);
 }
 
+/* 
+ * product of the hessian at x with v, with respect to transfer function, background,
+ * and uq and us of continuum. the continuum is linear in uq and us, and chisq_line is
+ * bilinear in image and continuum, which gives the cross terms.
+ */
+void PixonDRW::compute_hessian_vector(const double *x, const double *v, double *hv)
+{
+  int i;
+  double *pv = (double *)v + npixel + 1, *res_mat = workspace, *res_cross = workspace + cont.size;
+
+  evaluate(x, true);
+
+  perturb_image(v);
+  /* perturbed continuum, the same linear map as compute_cont */
+  multiply_matvec(PQmat, pv+nq, cont.size, hv_cont);
+  for(i=0; i<cont.size; i++)
+  {
+    hv_cont[i] += QLmat[i] * pv[0];
+  }
+
+  /* perturbed line, from perturbed image and from perturbed continuum */
+  rmfft.convolve_bg(hv_image, npixel, ipositive, hv_line, v[npixel]);
+  rmfft.set_data(hv_cont, cont.size);
+  rmfft.convolve_bg(image, npixel, ipositive, resp_pixon, 0.0);
+  for(i=0; i<cont.size; i++)
+  {
+    hv_line[i] += resp_pixon[i];
+  }
+  perturb_residual();
+
+  /* with respect to image, the cross term correlates residuals with perturbed continuum */
+  rmfft.correlate_data(resid_cont, npixel, ipositive, conv_pixon);
+  rmfft.set_data(cont.flux, cont.size);
+  rmfft.correlate_data(hv_line, npixel, ipositive, grad_image);
+  for(i=0; i<npixel; i++)
+  {
+    grad_image[i] += conv_pixon[i];
+  }
+
+  /* with respect to continuum, the cross term correlates residuals with perturbed image */
+  interp_image_op.correlate(image, hv_resid, res_mat);
+  interp_image_op.correlate(hv_image, resid_weight, res_cross);
+  for(i=0; i<cont.size; i++)
+  {
+    res_mat[i] = 2.0 * (res_mat[i] + res_cross[i]);
+  }
+  // w.r.t uq
+  multiply_mat_MN(QLmat, res_mat, hv+npixel+1, nq, 1, cont.size);
+  // w.r.t us
+  multiply_mat_MN(PQmat, res_mat, hv+npixel+1+nq, cont.size, 1, cont.size);
+  /* hessian of prior */
+  for(i=0; i<cont.size+nq; i++)
+  {
+    hv[npixel+1+i] += 2.0 * pv[i];
+  }
+
+  compute_hessian_vector_image(v, hv);
+}
+
 void PixonDRW::compute_matrix()
 {
   double *PEmat1, *PEmat2, *PSmat;
@@ -383,25 +460,20 @@ void PixonDRW::set_covar_Pmat(double sigma, double tau, double alpha, double *PS
 double func_nlopt_cont_drw(const vector<double> &x, vector<double> &grad, void *f_data)
 {
   PixonDRW *pixon = (PixonDRW *)f_data;
-  double chisq, mem;
+  double f;
 
-  pixon->compute_rm_pixon(x.data());
+  f = pixon->evaluate(x.data(), !grad.empty());
   if (!grad.empty()) 
   {
     int i;
     
-    pixon->compute_post_grad(x.data());
-    pixon->compute_mem_grad(x.data());
-    
     for(i=0; i<pixon->npixel+1; i++)
       grad[i] = pixon->grad_chisq[i] + pixon->grad_mem[i];
 
     for(i=pixon->npixel+1; i<(int)grad.size(); i++)
       grad[i] = pixon->grad_chisq_cont[i-pixon->npixel-1];
   }
-  chisq = pixon->compute_post(x.data());
-  mem = pixon->compute_mem(x.data());
-  return chisq + mem;
+  return f;
 }
 
 
@@ -410,16 +482,8 @@ int func_tnc_cont_drw(double x[], double *f, double g[], void *state)
 {
   PixonDRW *pixon = (PixonDRW *)state;
   int i;
-  double chisq, mem;
 
-  pixon->compute_rm_pixon(x);
-  pixon->compute_post_grad(x);
-  pixon->compute_mem_grad(x);
-  
-  chisq = pixon->compute_post(x);
-  mem = pixon->compute_mem(x);
-
-  *f = chisq + mem;
+  *f = pixon->evaluate(x, true);
 
   for(i=0; i<pixon->npixel+1; i++)
     g[i] = pixon->grad_chisq[i] + pixon->grad_mem[i];
@@ -428,4 +492,13 @@ int func_tnc_cont_drw(double x[], double *f, double g[], void *state)
     g[i] = pixon->grad_chisq_cont[i - pixon->npixel - 1];
 
   return 0;
-}
\ No newline at end of file
+}
+
+/* hessian times vector for tnc */
+int hessp_tnc_cont_drw(double x[], double v[], double hv[], void *state)
+{
+  PixonDRW *pixon = (PixonDRW *)state;
+
+  pixon->compute_hessian_vector(x, v, hv);
+  return 0;
+}
@@ -16,18 +16,20 @@ class PixonDRW:public Pixon
 {
   public:
     PixonDRW();
-    PixonDRW(Data& cont_data_in, Data& cont_in, Data& line_data_in, int npixel_in,  
+    PixonDRW(const PixonContext& ctx_in, Data& cont_data_in, Data& cont_in, Data& line_data_in, int npixel_in,  
               int npixon_size_max_in, double sigmad_in, double taud_in, double syserr_in,
-              int ipositive_in=0, double sensitivity_in=1.0);
+              int ipositive_in=0, double sensitivity_in=1.0, bool adjoint_grad_in=true);
     ~PixonDRW();
     void compute_cont(const double *x);
     void compute_rm_pixon(const double *x);
+    double evaluate(const double *x, bool want_grad);
     double compute_chisquare(const double *x);
     double compute_prior(const double *x);
     double compute_post(const double *x);
     void compute_post_grad(const double *x);
     double compute_mem(const double *x);
     void compute_mem_grad(const double *x);
+    void compute_hessian_vector(const double *x, const double *v, double *hv);
     
     void compute_matrix();
     void compute_matrix2();
@@ -35,6 +37,7 @@ class PixonDRW:public Pixon
     void set_covar_Pmat(double sigma, double tau, double alpha, double *PSmat);
 
     Data cont_data;  /* continuum data */
+    Arena arena_drw;  /* buffers of continuum reconstruction */
     
     double sigmad, taud, syserr;
 
@@ -53,8 +56,11 @@ class PixonDRW:public Pixon
     double *qhat;
     double *D_data, *W_data, *phi_data;
     double *D_recon, *W_recon, *phi_recon;
+    double *hv_cont; /* perturbation of continuum along the vector of a hessian product */
+    InterpOp interp_image_op; /* interpolation of image at line epochs shifted by continuum times */
 };
 
 double func_nlopt_cont_drw(const vector<double> &x, vector<double> &grad, void *f_data);
 int func_tnc_cont_drw(double x[], double *f, double g[], void *state);
+int hessp_tnc_cont_drw(double x[], double v[], double hv[], void *state);
 #endif
\ No newline at end of file
@@ -0,0 +1,261 @@
+/*
+ *  PIXON
+ *  A Pixon-based method for reconstructing velocity-delay map in reverberation mapping.
+ *
+ *  Yan-Rong Li, liyanrong@mail.ihep.ac.cn
+ *
+ */
+#include <iostream>
+#include <cstring>
+#include <cmath>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define INTERP_X86
+#endif
+
+#include "spectrum.hpp"
+#include "interp.hpp"
+
+using namespace std;
+
+/*==================================================================*/
+/* scalar kernels, also used for the tails of the vectorized ones */
+static void gather_scalar(const int *idx, const double *w0, const double *w1, const double *f, double *out, int n)
+{
+  int k;
+  for(k=0; k<n; k++)
+  {
+    out[k] = w0[k] * f[idx[k]] + w1[k] * f[idx[k]+1];
+  }
+}
+
+static double dot_scalar(const int *idx, const double *w0, const double *w1, const double *f, const double *w, int n)
+{
+  int k;
+  double sum = 0.0;
+  for(k=0; k<n; k++)
+  {
+    sum += w[k] * (w0[k] * f[idx[k]] + w1[k] * f[idx[k]+1]);
+  }
+  return sum;
+}
+
+#ifdef INTERP_X86
+/* 
+ * GCC 12 warns about the undefined source operand the intrinsic headers pass 
+ * to the unmasked gathers, all lanes are gathered.
+ */
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wuninitialized"
+#pragma GCC diagnostic ignored "-Wmaybe-uninitialized"
+/*==================================================================*/
+/* vectorized kernels with hardware gathers of the grid values */
+__attribute__((target("avx2,fma")))
+static void gather_avx2(const int *idx, const double *w0, const double *w1, const double *f, double *out, int n)
+{
+  __m128i vi;
+  int k;
+  for(k=0; k+4<=n; k+=4)
+  {
+    vi = _mm_loadu_si128((const __m128i *)(idx + k));
+    _mm256_storeu_pd(out + k, _mm256_fmadd_pd(_mm256_loadu_pd(w0 + k), _mm256_i32gather_pd(f, vi, 8),
+                     _mm256_mul_pd(_mm256_loadu_pd(w1 + k), _mm256_i32gather_pd(f + 1, vi, 8))));
+  }
+  gather_scalar(idx+k, w0+k, w1+k, f, out+k, n-k);
+}
+
+__attribute__((target("avx2,fma")))
+static double dot_avx2(const int *idx, const double *w0, const double *w1, const double *f, const double *w, int n)
+{
+  __m128i vi;
+  __m256d acc = _mm256_setzero_pd(), v;
+  double buf[4];
+  int k;
+  for(k=0; k+4<=n; k+=4)
+  {
+    vi = _mm_loadu_si128((const __m128i *)(idx + k));
+    v = _mm256_fmadd_pd(_mm256_loadu_pd(w0 + k), _mm256_i32gather_pd(f, vi, 8),
+                        _mm256_mul_pd(_mm256_loadu_pd(w1 + k), _mm256_i32gather_pd(f + 1, vi, 8)));
+    acc = _mm256_fmadd_pd(_mm256_loadu_pd(w + k), v, acc);
+  }
+  _mm256_storeu_pd(buf, acc);
+  return buf[0] + buf[1] + buf[2] + buf[3] + dot_scalar(idx+k, w0+k, w1+k, f, w+k, n-k);
+}
+
+__attribute__((target("avx512f")))
+static void gather_avx512(const int *idx, const double *w0, const double *w1, const double *f, double *out, int n)
+{
+  __m256i vi;
+  int k;
+  for(k=0; k+8<=n; k+=8)
+  {
+    vi = _mm256_loadu_si256((const __m256i *)(idx + k));
+    _mm512_storeu_pd(out + k, _mm512_fmadd_pd(_mm512_loadu_pd(w0 + k), _mm512_i32gather_pd(vi, f, 8),
+                     _mm512_mul_pd(_mm512_loadu_pd(w1 + k), _mm512_i32gather_pd(vi, f + 1, 8))));
+  }
+  gather_scalar(idx+k, w0+k, w1+k, f, out+k, n-k);
+}
+
+__attribute__((target("avx512f")))
+static double dot_avx512(const int *idx, const double *w0, const double *w1, const double *f, const double *w, int n)
+{
+  __m256i vi;
+  __m512d acc = _mm512_setzero_pd(), v;
+  int k;
+  for(k=0; k+8<=n; k+=8)
+  {
+    vi = _mm256_loadu_si256((const __m256i *)(idx + k));
+    v = _mm512_fmadd_pd(_mm512_loadu_pd(w0 + k), _mm512_i32gather_pd(vi, f, 8),
+                        _mm512_mul_pd(_mm512_loadu_pd(w1 + k), _mm512_i32gather_pd(vi, f + 1, 8)));
+    acc = _mm512_fmadd_pd(_mm512_loadu_pd(w + k), v, acc);
+  }
+  return _mm512_reduce_add_pd(acc) + dot_scalar(idx+k, w0+k, w1+k, f, w+k, n-k);
+}
+#pragma GCC diagnostic pop
+#endif
+
+/*==================================================================*/
+/* runtime dispatch, following the instruction set of the spectrum kernels */
+struct InterpKernels
+{
+  void (*gather)(const int *, const double *, const double *, const double *, double *, int);
+  double (*dot)(const int *, const double *, const double *, const double *, const double *, int);
+};
+
+static const InterpKernels interp_kernels[] =
+{
+  {gather_scalar, dot_scalar},
+#ifdef INTERP_X86
+  {gather_avx2, dot_avx2},
+  {gather_avx512, dot_avx512},
+#endif
+};
+
+/*==================================================================*/
+/* class InterpOp */
+InterpOp::InterpOp()
+{
+  n = nlag = ngrid = 0;
+  idx = NULL;
+  w0 = w1 = NULL;
+}
+
+InterpOp::~InterpOp()
+{
+  if(n*nlag > 0)
+  {
+    delete[] idx;
+    delete[] w0;
+    delete[] w1;
+  }
+}
+
+void InterpOp::allocate(int n_in, int nlag_in, int ngrid_in)
+{
+  if(n*nlag > 0)
+  {
+    delete[] idx;
+    delete[] w0;
+    delete[] w1;
+  }
+  n = n_in;
+  nlag = nlag_in;
+  ngrid = ngrid_in;
+  idx = new int[n*nlag];
+  w0 = new double[n*nlag];
+  w1 = new double[n*nlag];
+}
+
+/* weights of point k at time t, the same rule as the linear interpolation of Pixon */
+void InterpOp::set_point(int k, double t, const double *tgrid, double dt, bool zero_outside)
+{
+  int it;
+  double frac;
+
+  it = (t - tgrid[0])/dt;
+  if(it < 0 || it >= ngrid-1)
+  {
+    if(zero_outside)
+    {
+      idx[k] = 0;
+      w0[k] = w1[k] = 0.0;
+    }
+    else if(it < 0)
+    {
+      idx[k] = 0;
+      w0[k] = 1.0;
+      w1[k] = 0.0;
+    }
+    else
+    {
+      idx[k] = ngrid-2;
+      w0[k] = 0.0;
+      w1[k] = 1.0;
+    }
+    return;
+  }
+
+  frac = (t - tgrid[it])/dt;
+  idx[k] = it;
+  w0[k] = 1.0 - frac;
+  w1[k] = frac;
+}
+
+void InterpOp::set(const double *tgrid, int ngrid_in, double dt, const double *t, int n_in, bool zero_outside)
+{
+  int k;
+
+  allocate(n_in, 1, ngrid_in);
+  for(k=0; k<n; k++)
+  {
+    set_point(k, t[k], tgrid, dt, zero_outside);
+  }
+}
+
+void InterpOp::set_lag(const double *tgrid, int ngrid_in, double dt, const double *t, int n_in,
+                       const double *lag, int nlag_in, bool zero_outside)
+{
+  int i, k;
+
+  allocate(n_in, nlag_in, ngrid_in);
+  for(i=0; i<nlag; i++)
+  {
+    for(k=0; k<n; k++)
+    {
+      set_point(i*n+k, t[k] - lag[i], tgrid, dt, zero_outside);
+    }
+  }
+}
+
+void InterpOp::gather(const double *f, double *out)
+{
+  interp_kernels[spectrum_get_isa()].gather(idx, w0, w1, f, out, n*nlag);
+}
+
+void InterpOp::scatter(const double *w, double *g)
+{
+  int k;
+
+  for(k=0; k<ngrid; k++)
+  {
+    g[k] = 0.0;
+  }
+  for(k=0; k<n; k++)
+  {
+    g[idx[k]] += w[k] * w0[k];
+    g[idx[k]+1] += w[k] * w1[k];
+  }
+}
+
+void InterpOp::correlate(const double *f, const double *w, double *corr)
+{
+  int i, o;
+  const InterpKernels &kern = interp_kernels[spectrum_get_isa()];
+
+  for(i=0; i<nlag; i++)
+  {
+    o = i*n;
+    corr[i] = kern.dot(idx + o, w0 + o, w1 + o, f, w, n);
+  }
+}
@@ -0,0 +1,45 @@
+/*
+ *  PIXON
+ *  A Pixon-based method for reconstructing velocity-delay map in reverberation mapping.
+ *
+ *  Yan-Rong Li, liyanrong@mail.ihep.ac.cn
+ *
+ */
+#ifndef _INTERP_HPP
+
+#define _INTERP_HPP
+
+/*
+ * precomputed linear interpolation from a uniform grid onto fixed points,
+ * f(t[k]) = w0[k] * f[idx[k]] + w1[k] * f[idx[k]+1].
+ * the points are either epochs t[k], or epochs shifted by a set of lags, t[k] - lag[i],
+ * stored lag by lag, so that each lag is a contiguous band of the epochs.
+ * outside the grid, values are clamped to the ends, or zero if zero_outside.
+ */
+class InterpOp
+{
+  public:
+    InterpOp();
+    ~InterpOp();
+    /* tgrid is the uniform grid with interval dt */
+    void set(const double *tgrid, int ngrid, double dt, const double *t, int n, bool zero_outside=false);
+    void set_lag(const double *tgrid, int ngrid, double dt, const double *t, int n,
+                 const double *lag, int nlag, bool zero_outside=false);
+    /* out[k] = f(t[k]) */
+    void gather(const double *f, double *out);
+    /* transpose of gather, g[j] = sum_k w[k] * dt[k]/df[j] */
+    void scatter(const double *w, double *g);
+    /* corr[i] = sum_k w[k] * f(t[k] - lag[i]) */
+    void correlate(const double *f, const double *w, double *corr);
+
+    int n;      /* number of epochs */
+    int nlag;   /* number of lags, 1 without lags */
+    int ngrid;  /* size of the grid */
+    int *idx;   /* left grid index of each point */
+    double *w0, *w1; /* weights of the left and right grid points */
+  private:
+    void allocate(int n_in, int nlag_in, int ngrid_in);
+    void set_point(int k, double t, const double *tgrid, double dt, bool zero_outside);
+};
+
+#endif
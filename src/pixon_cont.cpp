@@ -15,43 +15,57 @@ PixonCont::PixonCont()
   grad_chisq_cont = NULL;
   grad_mem_cont = NULL;
   Kpixon = NULL;
+  ipixon_Kpixon = -1;
+  hv_image_cont = hv_residual_cont = hv_grad_cont = NULL;
 }
 
 PixonCont::PixonCont(
-  Data& cont_data_in, Data& cont_in, Data& line_data_in, int npixel_in,  
-  int npixon_in, int npixon_cont_in, int ipositive_in, double sensitivity_in
+  const PixonContext& ctx_in, Data& cont_data_in, Data& cont_in, Data& line_data_in, int npixel_in,  
+  int npixon_in, int npixon_cont_in, int ipositive_in, double sensitivity_in,
+  bool adjoint_grad_in
   )
-  :Pixon(cont_in, line_data_in, npixel_in, npixon_in, ipositive_in, sensitivity_in),
+  :Pixon(ctx_in, cont_in, line_data_in, npixel_in, npixon_in, ipositive_in, sensitivity_in, adjoint_grad_in),
    cont_data(cont_data_in),
-   pfft_cont(cont_in.size, npixon_cont_in),
+   pfft_cont(ctx_in, cont_in.size, npixon_cont_in),
    rmfft_pixon(cont_in.size, dt, fmax(npixel-ipositive_in, ipositive_in)),
    ipixon_cont(npixon_cont_in-1)
 {
-  residual_cont = new double[cont_data_in.size];
-  image_cont = new double[cont_in.size];
-  pseudo_image_cont = new double[cont_in.size];
-  grad_chisq_cont = new double[cont_in.size];
-  grad_mem_cont = new double[cont_in.size];
-  Kpixon = new double[2*cont_in.size];
+  /* buffers of continuum reconstruction in one arena */
+  arena_cont.add(&residual_cont, cont_data_in.size);
+  arena_cont.add(&image_cont, cont_in.size);
+  arena_cont.add(&pseudo_image_cont, cont_in.size);
+  arena_cont.add(&grad_chisq_cont, cont_in.size);
+  arena_cont.add(&grad_mem_cont, cont_in.size);
+  arena_cont.add(&Kpixon, 2*cont_in.size);
+  ipixon_Kpixon = -1;
+  arena_cont.add(&hv_image_cont, cont_in.size);
+  arena_cont.add(&hv_residual_cont, cont_data_in.size);
+  arena_cont.add(&hv_grad_cont, cont_in.size);
+  arena_cont.allocate();
+
+  /* interpolation from continuum grid to continuum data epochs */
+  interp_cont_op.set(cont.time, cont.size, dt, cont_data.time, cont_data.size);
+
+  /* rmline also depends on continuum parameters */
+  nx_rm = npixel+1+cont.size;
 }
 
 PixonCont::~PixonCont()
 {
-  if(npixel > 0)
-  {
-    delete[] residual_cont;
-    delete[] image_cont;
-    delete[] pseudo_image_cont;
-    delete[] grad_chisq_cont;
-    delete[] grad_mem_cont;
-    delete[] Kpixon;
-  }
+  /* buffers are freed with the arena */
+}
+
+/* the continuum pixon is switched to the reference too */
+void PixonCont::set_reference(bool ref)
+{
+  Pixon::set_reference(ref);
+  rmfft_pixon.reference = ref;
+  pfft_cont.conv_mode = ref?PIXON_CONV_DIRECT:ctx->conv_mode;
 }
 
 void PixonCont::compute_cont(const double *x)
 {
   int i;
-  double t;
   /* convolve with pixons for continuum */
   for(i=0; i<cont.size; i++)
   {
@@ -68,12 +82,22 @@ void PixonCont::compute_cont(const double *x)
   /* reset Data cont */
   cont.set_data(image_cont);
 
+  interp_cont_op.gather(cont.flux, residual_cont);
   for(i=0; i<cont_data.size; i++)
   {
-    t = cont_data.time[i];
-    residual_cont[i] = Pixon::interp_cont(t) - cont_data.flux[i];
+    residual_cont[i] -= cont_data.flux[i];
   }
 
+  /* total flux and entropy weight of continuum */
+  Itot_cont = 0.0;
+  for(i=0; i<cont.size; i++)
+  {
+    Itot_cont += image_cont[i];
+  }
+  mem_alpha_cont = log(compute_pixon_number_cont())/log(cont.size);
+
+  /* continuum changed, the last evaluation is out of date */
+  eval_valid = false;
   return;
 }
 
@@ -89,6 +113,27 @@ void PixonCont::compute_rm_pixon(const double *x)
   Pixon::compute_rm_pixon(x);
 }
 
+/* 
+ * evaluate the objective at x, including continuum, and its gradient if wanted.
+ * a repeated evaluation at the last x returns at once.
+ */
+double PixonCont::evaluate(const double *x, bool want_grad)
+{
+  double f;
+  if(eval_cached(x, npixel+1+cont.size, want_grad))
+    return f_eval;
+
+  compute_rm_pixon(x);
+  f = compute_chisquare(x) + compute_mem(x);
+  if(want_grad)
+  {
+    compute_chisquare_grad(x);
+    compute_mem_grad(x);
+  }
+  eval_store(x, npixel+1+cont.size, want_grad, f);
+  return f;
+}
+
 double PixonCont::compute_chisquare_cont(const double *x)
 {
   int i;
@@ -121,41 +166,22 @@ double PixonCont::compute_mem(const double *x)
 
 double PixonCont::compute_mem_cont(const double *x)
 {
-  double Itot, num, alpha;
   int i;
 
-  Itot = 0.0;
-  for(i=0; i<cont.size; i++)
-  {
-    Itot += image_cont[i];
-  }
-
-  num = compute_pixon_number_cont();
-  alpha = log(num)/log(cont.size);
-
   mem_cont = 0.0;
   for(i=0; i<cont.size; i++)
   {
-    mem_cont += (image_cont[i]/Itot) * log(image_cont[i]/Itot);
+    mem_cont += (image_cont[i]/Itot_cont) * log(image_cont[i]/Itot_cont);
   }
   
-  mem_cont *= 2.0*alpha;
+  mem_cont *= 2.0*mem_alpha_cont;
   return mem_cont;
 }
 
-/* compute pixon number of continuum */
+/* compute pixon number of continuum, the pixon size is uniform */
 double PixonCont::compute_pixon_number_cont()
 {
-  int i;
-  double num, psize;
-    
-  num = 0.0;
-  for(i=0; i<cont.size; i++)
-  {
-    psize = pfft_cont.pixon_sizes[ipixon_cont];
-    num += pixon_norm(psize);
-  }
-  return num;
+  return cont.size * ctx->pixon_table.norm[ipixon_cont];
 }
 
 /* compute total pixon number */
@@ -170,28 +196,80 @@ void PixonCont::compute_chisquare_grad(const double *x)
   compute_chisquare_grad_cont(x+npixel+1);  /* derivative of chisq_cont with respect to continuum */
 
   /* derivative of chisq_line with respect to continuum */
-  int i, j;
-  double psize, grad_in, grad_out, K, t;
+  if(adjoint_grad)
+    compute_chisquare_grad_line_cont_adjoint(x+npixel+1);
+  else
+    compute_chisquare_grad_line_cont_ref(x+npixel+1);
+}
+
+/* derivative of chisq_line with respect to continuum, 
+ * reference implementation with one RM convolution for each continuum pixel
+ */
+void PixonCont::compute_chisquare_grad_line_cont_ref(const double *x)
+{
+  int i, j, t;
+  double grad_out, *resp, *conv;
   
-  rmfft_pixon.set_resp_real(image, npixel, ipositive);
-  psize = pfft_cont.pixon_sizes[ipixon_cont]; /* uniform pixon size for continuum */
-  for(i=0; i<cont.size; i++)
+  /* weighted residuals */
+  for(j=0; j<line.size; j++)
   {
-    for(j=0; j<cont.size; j++)
-    {
-      resp_pixon[j] = pixon_function(j, i, psize);
-    }
-    rmfft_pixon.set_data(resp_pixon, cont.size);
-    rmfft_pixon.convolve_simple(conv_pixon);
+    resid_weight[j] = residual[j]/line.error[j]/line.error[j];
+  }
+
+  /* per-thread workspaces, only made once the reference gradient is used */
+  if(grad_threads_cont.nthread == 0)
+    grad_threads_cont.setup(&rmfft_pixon, resp_pixon, conv_pixon, cont.size, grad_nthreads);
 
-    grad_out = 0.0;
-    for(j=0; j<line.size; j++)
+  /* continuum pixels are independent, each thread convolves with its own workspace */
+  #pragma omp parallel num_threads(grad_threads_cont.nthread) private(i, j, t, grad_out, resp, conv)
+  {
+    t = grad_thread_num();
+    RMFFT &rm = *grad_threads_cont.rmfft[t];
+    resp = grad_threads_cont.buf1[t];
+    conv = grad_threads_cont.buf2[t];
+    rm.set_resp_real(image, npixel, ipositive);
+
+    /* uniform pixon size for continuum */
+    #pragma omp for schedule(static)
+    for(i=0; i<cont.size; i++)
     {
-      t = line.time[j];
-      grad_in = interp_pixon(t);
-      grad_out += grad_in * residual[j]/line.error[j]/line.error[j];
+      for(j=0; j<cont.size; j++)
+      {
+        resp[j] = ctx->pixon_table.value(ipixon_cont, j-i);
+      }
+      rm.set_data(resp, cont.size);
+      rm.convolve_simple(conv);
+
+      interp_line_op.correlate(conv, resid_weight, &grad_out);
+      grad_chisq_cont[i] += grad_out * 2.0; /* chisq = chisq_cont + chisq_line */
     }
-    grad_chisq_cont[i] += grad_out * 2.0; /* chisq = chisq_cont + chisq_line */
+  }
+}
+
+/* derivative of chisq_line with respect to continuum with adjoint method,
+ * the weighted residuals are scattered onto continuum grid, 
+ * then correlated with transfer function and continuum pixon kernel.
+ */
+void PixonCont::compute_chisquare_grad_line_cont_adjoint(const double *x)
+{
+  int i;
+
+  /* weighted residuals */
+  for(i=0; i<line.size; i++)
+  {
+    resid_weight[i] = residual[i]/line.error[i]/line.error[i];
+  }
+  scatter_line(resid_weight, resid_cont);
+
+  /* gradient with respect to continuum image */
+  rmfft_pixon.set_resp_real(image, npixel, ipositive);
+  rmfft_pixon.correlate_resp(resid_cont, conv_pixon);
+
+  /* gradient with respect to continuum pseudo image */
+  pfft_cont.convolve_transpose(conv_pixon, ipixon_cont, resp_pixon);
+  for(i=0; i<cont.size; i++)
+  {
+    grad_chisq_cont[i] += resp_pixon[i] * 2.0; /* chisq = chisq_cont + chisq_line */
   }
 }
 /* Kpixon = K((tj-ti)/psize) */
@@ -212,29 +290,43 @@ double PixonCont::interp_Kpixon(double t)
 /* derivative of chisq_cont with respect to continuum */
 void PixonCont::compute_chisquare_grad_cont(const double *x)
 {
-  int i, j, jt, jrange1, jrange2;
+  correlate_Kpixon(residual_cont, grad_chisq_cont);
+}
+
+/* 
+ * grad[i] = 2 sum_j K(tj - ti) * resid[j]/error[j]^2 over continuum data around pixel i,
+ * the chisq_cont gradient for residuals resid
+ */
+void PixonCont::correlate_Kpixon(const double *resid, double *grad)
+{
+  int i, j, jrange1, jrange2;
   double tj;
   double psize, grad_in, K, jt_real;
   
-  /* uniform pixon size */
+  /* uniform pixon size, the kernel is tabulated again only when it changes */
   psize = pfft_cont.pixon_sizes[ipixon_cont];
-  for(j=0; j<cont.size*2; j++)
+  if(ipixon_Kpixon != ipixon_cont)
   {
-    Kpixon[j] = pixon_function(j-cont.size, 0, psize);  /* correspoding to time from -n*dt to +n*dt */
+    for(j=0; j<cont.size*2; j++)
+    {
+      Kpixon[j] = ctx->pixon_table.value(ipixon_cont, j-cont.size);  /* correspoding to time from -n*dt to +n*dt */
+    }
+    ipixon_Kpixon = ipixon_cont;
   }
+  #pragma omp parallel for num_threads(grad_nthreads) private(j, jrange1, jrange2, tj, K, grad_in) schedule(static)
   for(i=0; i<cont.size; i++)
   {
-    jrange1 = fmin(fmax(0, i - pixon_size_factor * psize), cont_data.size-1);
-    jrange2 = fmin(cont_data.size-1, i + pixon_size_factor * psize);
+    jrange1 = fmin(fmax(0, i - ctx->pixon_size_factor * psize), cont_data.size-1);
+    jrange2 = fmin(cont_data.size-1, i + ctx->pixon_size_factor * psize);
 
     grad_in = 0.0;
     for(j=jrange1; j<=jrange2; j++)
     {
       tj = cont_data.time[j];      
       K = interp_Kpixon(tj - cont.time[i]);
-      grad_in += K * residual_cont[j]/cont_data.error[j]/cont_data.error[j];
+      grad_in += K * resid[j]/cont_data.error[j]/cont_data.error[j];
     }
-    grad_chisq_cont[i] = 2.0 * grad_in;
+    grad[i] = 2.0 * grad_in;
   }
 }
 
@@ -246,29 +338,112 @@ void PixonCont::compute_mem_grad(const double *x)
 
 void PixonCont::compute_mem_grad_cont(const double *x)
 {
-  double Itot, num, alpha, grad_in, psize, K;
-  int i, j, jrange1, jrange2;
-  Itot = 0.0;
+  int i;
+  
+  /* gradient with respect to continuum image */
   for(i=0; i<cont.size; i++)
   {
-    Itot += image_cont[i];
+    conv_pixon[i] = 1.0 + log(image_cont[i]/Itot_cont);
   }
-  num = compute_pixon_number_cont();
-  alpha = log(num)/log(cont.size);
-  
-  /* uniform pixon size */
-  psize = pfft_cont.pixon_sizes[ipixon_cont];
+
+  /* uniform pixon size, transpose of the continuum pixon convolution */
+  pfft_cont.convolve_transpose(conv_pixon, ipixon_cont, resp_pixon);
   for(i=0; i<cont.size; i++)
   {       
-    jrange1 = fmax(0, i - pixon_size_factor * psize);
-    jrange2 = fmin(cont.size-1, i + pixon_size_factor*psize);
-    grad_in = 0.0;
-    for(j=jrange1; j<=jrange2; j++)
-    {
-      K = pixon_function(j, i, psize);
-      grad_in += (1.0 + log(image_cont[j]/Itot)) * K;
-    }
-    grad_mem_cont[i] = 2.0 * alpha * grad_in / Itot;
+    grad_mem_cont[i] = 2.0 * mem_alpha_cont * resp_pixon[i] / Itot_cont;
+  }
+}
+
+/* 
+ * product of the hessian at x with v, with respect to transfer function, background 
+ * and continuum. chisq_line is bilinear in image and continuum, the cross terms 
+ * come from the convolutions with the perturbed continuum and the perturbed image.
+ */
+void PixonCont::compute_hessian_vector(const double *x, const double *v, double *hv)
+{
+  int i;
+
+  evaluate(x, true);
+
+  perturb_image(v);
+  pfft_cont.convolve(v + npixel + 1, ipixon_cont, hv_image_cont);
+
+  /* perturbed line, from perturbed image and from perturbed continuum */
+  rmfft.convolve_bg(hv_image, npixel, ipositive, hv_line, v[npixel]);
+  rmfft.set_data(hv_image_cont, cont.size);
+  rmfft.convolve_bg(image, npixel, ipositive, resp_pixon, 0.0);
+  for(i=0; i<cont.size; i++)
+  {
+    hv_line[i] += resp_pixon[i];
+  }
+  perturb_residual();
+
+  /* with respect to image, the cross term correlates residuals with perturbed continuum */
+  rmfft.correlate_data(resid_cont, npixel, ipositive, conv_pixon);
+  rmfft.set_data(image_cont, cont.size);
+  rmfft.correlate_data(hv_line, npixel, ipositive, grad_image);
+  for(i=0; i<npixel; i++)
+  {
+    grad_image[i] += conv_pixon[i];
+  }
+
+  /* with respect to continuum image, the cross term correlates residuals with perturbed image */
+  rmfft_pixon.set_resp_real(image, npixel, ipositive);
+  rmfft_pixon.correlate_resp(hv_line, hv_grad_cont);
+  rmfft_pixon.set_resp_real(hv_image, npixel, ipositive);
+  rmfft_pixon.correlate_resp(resid_cont, conv_pixon);
+  for(i=0; i<cont.size; i++)
+  {
+    hv_grad_cont[i] = 2.0 * (hv_grad_cont[i] + conv_pixon[i]);
+  }
+
+  compute_hessian_vector_image(v, hv);
+  compute_hessian_vector_cont_image(hv + npixel + 1);
+}
+
+/* product of the hessian of chisq_cont + mem_cont at continuum x with v */
+void PixonCont::compute_hessian_vector_cont(const double *x, const double *v, double *hv)
+{
+  int i;
+
+  compute_cont(x);
+  compute_mem_grad_cont(x);
+
+  pfft_cont.convolve(v, ipixon_cont, hv_image_cont);
+  for(i=0; i<cont.size; i++)
+  {
+    hv_grad_cont[i] = 0.0;
+  }
+  compute_hessian_vector_cont_image(hv);
+}
+
+/* 
+ * complete the hessian product for continuum, given the perturbed continuum image in 
+ * hv_image_cont and the perturbation of chisq_line gradient with respect to 
+ * continuum image in hv_grad_cont. chisq_cont and mem_cont are added here.
+ */
+void PixonCont::compute_hessian_vector_cont_image(double *hv)
+{
+  int i;
+  double dItot;
+
+  dItot = 0.0;
+  for(i=0; i<cont.size; i++)
+  {
+    dItot += hv_image_cont[i];
+  }
+
+  for(i=0; i<cont.size; i++)
+  {
+    hv_grad_cont[i] += 2.0 * mem_alpha_cont/Itot_cont * (hv_image_cont[i]/image_cont[i] - dItot/Itot_cont);
+  }
+  pfft_cont.convolve_transpose(hv_grad_cont, ipixon_cont, conv_pixon);
+
+  interp_cont_op.gather(hv_image_cont, hv_residual_cont);
+  correlate_Kpixon(hv_residual_cont, resp_pixon);
+  for(i=0; i<cont.size; i++)
+  {
+    hv[i] = conv_pixon[i] + resp_pixon[i] - grad_mem_cont[i] * dItot/Itot_cont;
   }
 }
 
@@ -277,6 +452,8 @@ void PixonCont::reduce_ipixon_cont()
   int i;
   pfft_cont.reduce_pixon_min();
   ipixon_cont--;
+  eval_valid = false;
+  rm_valid = false;
 }
 
 void PixonCont::increase_ipixon_cont()
@@ -284,6 +461,8 @@ void PixonCont::increase_ipixon_cont()
   int i;
   pfft_cont.increase_pixon_min();
   ipixon_cont++;
+  eval_valid = false;
+  rm_valid = false;
 }
 
 /* function for nlopt */
@@ -331,29 +510,33 @@ int func_tnc_cont(double x[], double *f, double g[], void *state)
   return 0;
 }
 
+/* hessian times vector for tnc */
+int hessp_tnc_cont(double x[], double v[], double hv[], void *state)
+{
+  PixonCont *pixon = (PixonCont *)state;
+
+  pixon->compute_hessian_vector_cont(x, v, hv);
+  return 0;
+}
+
 /* function for nlopt */
 double func_nlopt_cont_rm(const vector<double> &x, vector<double> &grad, void *f_data)
 {
   PixonCont *pixon = (PixonCont *)f_data;
-  double chisq, mem;
+  double f;
 
-  pixon->compute_rm_pixon(x.data());
+  f = pixon->evaluate(x.data(), !grad.empty());
   if (!grad.empty()) 
   {
     int i;
     
-    pixon->compute_chisquare_grad(x.data());
-    pixon->compute_mem_grad(x.data());
-    
     for(i=0; i<pixon->npixel+1; i++)
       grad[i] = pixon->grad_chisq[i] + pixon->grad_mem[i];
 
     for(i=pixon->npixel+1; i<(int)grad.size(); i++)
       grad[i] = pixon->grad_chisq_cont[i-pixon->npixel-1] + pixon->grad_mem_cont[i-pixon->npixel-1];
   }
-  chisq = pixon->compute_chisquare(x.data());
-  mem = pixon->compute_mem(x.data());
-  return chisq + mem;
+  return f;
 }
 
 
@@ -362,16 +545,8 @@ int func_tnc_cont_rm(double x[], double *f, double g[], void *state)
 {
   PixonCont *pixon = (PixonCont *)state;
   int i;
-  double chisq, mem;
 
-  pixon->compute_rm_pixon(x);
-  pixon->compute_chisquare_grad(x);
-  pixon->compute_mem_grad(x);
-  
-  chisq = pixon->compute_chisquare(x);
-  mem = pixon->compute_mem(x);
-
-  *f = chisq + mem;
+  *f = pixon->evaluate(x, true);
 
   for(i=0; i<pixon->npixel+1; i++)
     g[i] = pixon->grad_chisq[i] + pixon->grad_mem[i];
@@ -380,4 +555,13 @@ int func_tnc_cont_rm(double x[], double *f, double g[], void *state)
     g[i] = pixon->grad_chisq_cont[i - pixon->npixel - 1] + pixon->grad_mem_cont[i - pixon->npixel - 1];
 
   return 0;
-}
\ No newline at end of file
+}
+
+/* hessian times vector for tnc */
+int hessp_tnc_cont_rm(double x[], double v[], double hv[], void *state)
+{
+  PixonCont *pixon = (PixonCont *)state;
+
+  pixon->compute_hessian_vector(x, v, hv);
+  return 0;
+}
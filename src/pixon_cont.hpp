@@ -16,19 +16,28 @@ class PixonCont:public Pixon
 {
   public:
     PixonCont();
-    PixonCont(Data& cont_data_in, Data& cont_in, Data& line_data_in, int npixel_in,  
-              int npixon_in, int npixon_in_cont, int ipositive_in=0, double sensitivity=1.0);
+    PixonCont(const PixonContext& ctx_in, Data& cont_data_in, Data& cont_in, Data& line_data_in, int npixel_in,  
+              int npixon_in, int npixon_in_cont, int ipositive_in=0, double sensitivity=1.0,
+              bool adjoint_grad=true);
     ~PixonCont();
+    void set_reference(bool ref);
     void compute_cont(const double *x);
     void compute_rm_pixon(const double *x);
+    double evaluate(const double *x, bool want_grad);
     double compute_chisquare(const double *x);
     double compute_chisquare_cont(const double *x);
     void compute_chisquare_grad(const double *x);
     void compute_chisquare_grad_cont(const double *x);
+    void compute_chisquare_grad_line_cont_ref(const double *x);
+    void compute_chisquare_grad_line_cont_adjoint(const double *x);
     double compute_mem(const double *x);
     double compute_mem_cont(const double *x);
     void compute_mem_grad(const double *x);
     void compute_mem_grad_cont(const double *x);
+    void correlate_Kpixon(const double *resid, double *grad);
+    void compute_hessian_vector(const double *x, const double *v, double *hv);
+    void compute_hessian_vector_cont(const double *x, const double *v, double *hv);
+    void compute_hessian_vector_cont_image(double *hv);
     double compute_pixon_number_cont();
     double compute_pixon_number();
     void reduce_ipixon_cont();
@@ -39,8 +48,11 @@ class PixonCont:public Pixon
     Data cont_data;  /* continuum data */
     PixonUniFFT pfft_cont; /* uniform pixon, for continuum */
     RMFFT rmfft_pixon;
+    Arena arena_cont;  /* buffers of continuum reconstruction */
+    GradThreads grad_threads_cont; /* workspaces of the reference chisq_line gradient to continuum */
     
     double chisq_cont, mem_cont, chisq_line, mem_line;
+    double Itot_cont, mem_alpha_cont; /* total flux and entropy weight of continuum */
 
     double *residual_cont;   /* residual for continuum */
     int ipixon_cont;   /* pixon map  for continuum */
@@ -50,12 +62,19 @@ class PixonCont:public Pixon
     double *grad_mem_cont;
     
     double *Kpixon;
+    int ipixon_Kpixon;  /* pixon size Kpixon is tabulated with */
+    double *hv_image_cont;    /* perturbation of continuum image along the vector of a hessian product */
+    double *hv_residual_cont; /* perturbation of residuals for continuum */
+    double *hv_grad_cont;     /* perturbation of gradient with respect to continuum image */
+    InterpOp interp_cont_op; /* interpolation from continuum grid to continuum data epochs */
   private:
 };
 
 double func_nlopt_cont(const vector<double> &x, vector<double> &grad, void *f_data);
 int func_tnc_cont(double x[], double *f, double g[], void *state);
+int hessp_tnc_cont(double x[], double v[], double hv[], void *state);
 
 double func_nlopt_cont_rm(const vector<double> &x, vector<double> &grad, void *f_data);
 int func_tnc_cont_rm(double x[], double *f, double g[], void *state);
+int hessp_tnc_cont_rm(double x[], double v[], double hv[], void *state);
 #endif
\ No newline at end of file
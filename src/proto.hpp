@@ -7,14 +7,27 @@
  */
 #include "utilities.hpp"
 
+/* per-run options of the reconstruction drivers */
+struct RunOptions
+{
+  RunOptions():tnc_messages(TNC_MSG_INFO|TNC_MSG_EXIT), precision_report(true){}
+  int tnc_messages;       /* TNC messages, to stderr */
+  bool precision_report;  /* report the precision of single-precision FFTs */
+};
+
 int run(Config &cfg);
+void run_mode(int, Data&, Data&, Data&, double*, int, int&, int, double, double, double, Config&, const PixonContext&, const RunOptions&);
+void run_modes_concurrent(Data&, Data&, Data&, int, int, int, double, double, double, Config&, const PixonContext&, const RunOptions&);
 
-void run_contfix_uniform(Data&, Data&, double*, int, int&, int, Config&);
-void run_contfix(Data&, Data&, double*, int, int&, int, Config&);
-void run_pixon_uniform(Data&, Data&, Data&, double *, int, int&, int, Config&);
-void run_pixon(Data&, Data&, Data&, double *, int, int&, int, Config&);
-void run_drw_uniform(Data&, Data&, Data&, double *, int, int&, int, double, double, double, Config&);
-void run_drw(Data&, Data&, Data&, double *, int, int&, int, double, double, double, Config&);
+void run_contfix_uniform(Data&, Data&, double*, int, int&, int, Config&, const PixonContext&, const RunOptions&);
+void run_contfix(Data&, Data&, double*, int, int&, int, Config&, const PixonContext&, const RunOptions&);
+void run_pixon_uniform(Data&, Data&, Data&, double *, int, int&, int, Config&, const PixonContext&, const RunOptions&);
+void run_pixon(Data&, Data&, Data&, double *, int, int&, int, Config&, const PixonContext&, const RunOptions&);
+void run_drw_uniform(Data&, Data&, Data&, double *, int, int&, int, double, double, double, Config&, const PixonContext&, const RunOptions&);
+void run_drw(Data&, Data&, Data&, double *, int, int&, int, double, double, double, Config&, const PixonContext&, const RunOptions&);
 
 void test();
-void test_nlopt();
\ No newline at end of file
+void test_nlopt();
+void test_fft_size();
+void test_spectrum();
+void test_hessp();
\ No newline at end of file
@@ -12,6 +12,9 @@
 #include <cmath>
 #include <cstring>
 #include <random>
+#include <sstream>
+#include <thread>
+#include <atomic>
 #include <nlopt.hpp>
 #include <fftw3.h>
 
@@ -24,6 +27,9 @@
 
 using namespace std;
 
+/* initial number of continuum pixon sizes in run_pixon and run_pixon_uniform */
+#define NPIXON_SIZE_CONT 10
+
 int run(Config &cfg)
 {
   Data cont, line;
@@ -40,8 +46,15 @@ int run(Config &cfg)
   double tforward = fmax((line.time[line.size-1] - cfg.tau_range_low + text_rec) - cont.time[cont.size-1], text_rec);
   double sigmad, taud, syserr;
 
+  /* FFTW planning, reuse wisdom of previous runs */
+  set_fft_threads(cfg.fft_threads, cfg.fft_thread_min);
+  set_grad_threads(cfg.grad_threads);
+  set_fft_planner(cfg.fft_planner);
+  import_fft_wisdom(cfg.fftw_wisdom);
+  set_conv_cost(cfg.conv_cost);
+
   /* use drw to reconstruct continuum */
-  cont_model = new ContModel(cont, tback, tforward, cfg.tau_interval);
+  ContModel *cont_model = new ContModel(cont, tback, tforward, cfg.tau_interval);
   cont_model->mcmc();
   cont_model->get_best_params();
   cont_model->recon();
@@ -52,12 +65,10 @@ int run(Config &cfg)
   int npixel;  /* number of pixels */
   int npixon_size, npixon_size0; 
   int ipositive_tau; /* index of zero lag */
+  int model;
   double *pimg;
 
-  pixon_sub_factor = cfg.pixon_sub_factor;
-  pixon_size_factor = cfg.pixon_size_factor;
-  pixon_map_low_bound = cfg.pixon_map_low_bound;
-  npixon_size0 = cfg.max_pixon_size*pixon_sub_factor/pixon_size_factor;
+  npixon_size0 = cfg.max_pixon_size*cfg.pixon_sub_factor/cfg.pixon_size_factor;
 
   /* number of pixels */
   npixel = (cfg.tau_range_up - cfg.tau_range_low) / (cont_model->cont_recon.time[1]-cont_model->cont_recon.time[0]);
@@ -68,61 +79,53 @@ int run(Config &cfg)
   /* used to restore image  */
   pimg = new double[npixel+1+cont_model->cont_recon.size+1];
 
-  /* setup pixon type */
-  switch(cfg.pixon_basis_type)
+  /* setup pixon factors and type, and tabulate its kernels for the line and continuum pixons,
+   * the context is read-only afterwards */
+  PixonContext ctx;
+  ctx.setup(cfg.pixon_basis_type, cfg.pixon_size_factor, cfg.pixon_sub_factor, cfg.pixon_map_low_bound);
+  ctx.reserve(max(npixon_size0, NPIXON_SIZE_CONT));
+  ctx.set_conv(cfg.pixon_conv);
+
+  RunOptions opts;
+  
+  if(cfg.drv_lc_model == 3 && cfg.run_threads > 1)
   {
-    case 0:  /* parabloid */      
-      pixon_function = PixonBasis::parabloid;
-      pixon_norm = PixonBasis::parabloid_norm;
-      break;
+    /* TNC messages go to stderr, they would interleave while the modes run concurrently */
+    opts.tnc_messages = TNC_MSG_NONE;
 
-    case 1:  /* Gaussian */
-      PixonBasis::norm_gaussian = sqrt(2.0*M_PI) * erf(3.0*pixon_size_factor/sqrt(2.0));
+    run_modes_concurrent(cont, cont_model->cont_recon, line, npixel, npixon_size0, ipositive_tau, 
+                         sigmad, taud, syserr, cfg, ctx, opts);
+  }
+  else 
+  {
+    for(model=0; model<3; model++)
+    {
+      if(cfg.drv_lc_model == model || cfg.drv_lc_model == 3)
+      {
+        npixon_size = npixon_size0;
+        run_mode(model, cont, cont_model->cont_recon, line, pimg, npixel, npixon_size, ipositive_tau, 
+                 sigmad, taud, syserr, cfg, ctx, opts);
+      }
+    }
+  }
 
-      pixon_function = PixonBasis::gaussian;
-      pixon_norm = PixonBasis::gaussian_norm;
-      break;
-    
-    case 2: /* modified Gaussian */
-      PixonBasis::coeff1_modified_gaussian = exp(-0.5 * pixon_size_factor*3.0*pixon_size_factor*3.0);
-      PixonBasis::coeff2_modified_gaussian = 1.0 - PixonBasis::coeff1_modified_gaussian;
-      PixonBasis::norm_gaussian = (sqrt(2.0*M_PI) * erf(3.0*pixon_size_factor/sqrt(2.0)) 
-                    - 2.0*3.0*pixon_size_factor * PixonBasis::coeff1_modified_gaussian)/PixonBasis::coeff2_modified_gaussian;
-      
-      pixon_function = PixonBasis::modified_gaussian;
-      pixon_norm = PixonBasis::modified_gaussian_norm;
-      break;
-    
-    case 3:  /* Lorentz */ 
-      pixon_function = PixonBasis::lorentz;
-      pixon_norm = PixonBasis::lorentz_norm;
-      break;
-    
-    case 4: /* Wendland */
-      pixon_function = PixonBasis::wendland;
-      pixon_norm = PixonBasis::wendland_norm;
-      break;
-    
-    case 5:  /* triangle */ 
-      pixon_function = PixonBasis::triangle;
-      pixon_norm = PixonBasis::triangle_norm;
-      break;
-    
-    case 6:  /* top-hat */ 
-      pixon_sub_factor = 1; /* enforce to 1 */
-      pixon_function = PixonBasis::tophat;
-      pixon_norm = PixonBasis::tophat_norm;
-      break;
-    
-    default:  /* default */
-      PixonBasis::norm_gaussian = sqrt(2.0*M_PI) * erf(3.0*pixon_size_factor/sqrt(2.0));
+  export_fft_wisdom(cfg.fftw_wisdom);
+  destroy_fft_plans();
 
-      pixon_function = PixonBasis::gaussian;
-      pixon_norm = PixonBasis::gaussian_norm;
-      break;
-  }
-  
-  if(cfg.drv_lc_model == 0 || cfg.drv_lc_model == 3)
+  delete[] pimg;
+  delete cont_model;
+  return 0;
+}
+
+/*
+ * one reconstruction mode of drv_lc_model, 
+ * 0: continuum free with pixon, 1: continuum free with drw, 2: continuum fixed with drw.
+ */
+void run_mode(int model, Data& cont, Data& cont_recon, Data& line, double *pimg, int npixel, int& npixon_size, 
+              int ipositive_tau, double sigmad, double taud, double syserr, Config& cfg, const PixonContext& ctx,
+              const RunOptions& opts)
+{
+  if(model == 0)
   {
     /* continuum free with pixon, line with pixon 
      * resp_pixon_uniform.txt, resp_pixon.txt
@@ -130,17 +133,11 @@ int run(Config &cfg)
      * cont_pixon_uniform.txt, cont_pixon.txt
      */
     if(cfg.pixon_uniform)
-    {
-      npixon_size = npixon_size0;
-      run_pixon_uniform(cont, cont_model->cont_recon, line, pimg, npixel, npixon_size, ipositive_tau, cfg);
-    }
+      run_pixon_uniform(cont, cont_recon, line, pimg, npixel, npixon_size, ipositive_tau, cfg, ctx, opts);
     else 
-    {
-      npixon_size = npixon_size0;
-      run_pixon(cont, cont_model->cont_recon, line, pimg, npixel, npixon_size, ipositive_tau, cfg);
-    }
+      run_pixon(cont, cont_recon, line, pimg, npixel, npixon_size, ipositive_tau, cfg, ctx, opts);
   }
-  if(cfg.drv_lc_model == 1 || cfg.drv_lc_model == 3)
+  else if(model == 1)
   {
     /* continuum free with drw, line with pixon 
      * resp_drw_uniform.txt, resp_drw.txt
@@ -148,36 +145,64 @@ int run(Config &cfg)
      * cont_drw_uniform.txt, cont_drw.txt
      */
     if(cfg.pixon_uniform)
-    {
-      npixon_size = npixon_size0;
-      run_drw_uniform(cont, cont_model->cont_recon, line, pimg, npixel, npixon_size, ipositive_tau, sigmad, taud, syserr, cfg);
-    }
+      run_drw_uniform(cont, cont_recon, line, pimg, npixel, npixon_size, ipositive_tau, sigmad, taud, syserr, cfg, ctx, opts);
     else 
-    {
-      npixon_size = npixon_size0;
-      run_drw(cont, cont_model->cont_recon, line, pimg, npixel, npixon_size, ipositive_tau, sigmad, taud, syserr, cfg);
-    }
+      run_drw(cont, cont_recon, line, pimg, npixel, npixon_size, ipositive_tau, sigmad, taud, syserr, cfg, ctx, opts);
   }
-  if(cfg.drv_lc_model == 2 || cfg.drv_lc_model == 3)
+  else
   {
     /* continuum fixed with drw, line with pixon 
      * resp_contfix_uniform.txt, resp_contfix.txt
      * line_contfix_uniform.txt line_contfix.txt 
      */
     if(cfg.pixon_uniform)
-    {
-      npixon_size = npixon_size0;
-      run_contfix_uniform(cont_model->cont_recon, line, pimg, npixel, npixon_size, ipositive_tau, cfg);
-    }
+      run_contfix_uniform(cont_recon, line, pimg, npixel, npixon_size, ipositive_tau, cfg, ctx, opts);
     else 
-    {
-      npixon_size = npixon_size0;
-      run_contfix(cont_model->cont_recon, line, pimg, npixel, npixon_size, ipositive_tau, cfg);
-    }
+      run_contfix(cont_recon, line, pimg, npixel, npixon_size, ipositive_tau, cfg, ctx, opts);
   }
+}
 
-  delete[] pimg;
-  return 0;
+/*
+ * run the three modes of drv_lc_model = 3 on cfg.run_threads threads, each mode with 
+ * its own image buffer. the modes only read the continuum reconstruction, the data and ctx,
+ * and write to different files. the messages of a mode are buffered and printed at once 
+ * when it finishes, or before an error stops the run (see pixon_fatal).
+ */
+void run_modes_concurrent(Data& cont, Data& cont_recon, Data& line, int npixel, int npixon_size0, 
+                          int ipositive_tau, double sigmad, double taud, double syserr, Config& cfg, const PixonContext& ctx,
+                          const RunOptions& opts)
+{
+  const int nmode = 3;
+  int i, nthread = min(cfg.run_threads, nmode);
+  atomic<int> next(0);
+  vector<thread> threads;
+
+  cout<<"Start "<<nmode<<" modes on "<<nthread<<" threads."<<endl;
+  for(i=0; i<nthread; i++)
+  {
+    threads.push_back(thread([&]()
+    {
+      int model, npixon_size;
+      double *pimg = new double[npixel+1+cont_recon.size+1];
+      ostringstream buf;
+
+      set_pixon_log(&buf);
+      while((model = next++) < nmode)
+      {
+        npixon_size = npixon_size0;
+        run_mode(model, cont, cont_recon, line, pimg, npixel, npixon_size, ipositive_tau, 
+                 sigmad, taud, syserr, cfg, ctx, opts);
+
+        flush_pixon_log();
+      }
+      set_pixon_log(NULL);
+      delete[] pimg;
+    }));
+  }
+  for(i=0; i<nthread; i++)
+  {
+    threads[i].join();
+  }
 }
 
 /*
@@ -185,14 +210,15 @@ int run(Config &cfg)
  *
  */
 void run_drw(Data& cont_data, Data& cont_recon, Data& line, double *pimg, int npixel, 
-                    int& npixon_size, int ipositive_tau, double sigmad, double taud, double syserr, Config& cfg)
+                    int& npixon_size, int ipositive_tau, double sigmad, double taud, double syserr, Config& cfg, const PixonContext& ctx,
+                    const RunOptions& opts)
 {
-  cout<<"************************************************************"<<endl;
-  cout<<"Start run_drw..."<<endl;
-  cout<<"npixon_size:"<<npixon_size<<endl;
+  pixon_log()<<"************************************************************"<<endl;
+  pixon_log()<<"Start run_drw..."<<endl;
+  pixon_log()<<"npixon_size:"<<npixon_size<<endl;
   int i, iter;
   bool flag;
-  PixonDRW pixon(cont_data, cont_recon, line, npixel, npixon_size, sigmad, taud, syserr, ipositive_tau, cfg.sensitivity);
+  PixonDRW pixon(ctx, cont_data, cont_recon, line, npixel, npixon_size, sigmad, taud, syserr, ipositive_tau, cfg.sensitivity, cfg.adjoint_grad);
   void *args = (void *)&pixon;
   double f, f_old, num, num_old, chisq, chisq_old, df, dnum;
 
@@ -244,23 +270,24 @@ void run_drw(Data& cont_data, Data& cont_recon, Data& line, double *pimg, int np
   
   opt0.optimize(x, f);
   rc = tnc(ndim, x.data(), &f, g.data(), func_tnc_cont_drw, args, low.data(), up.data(), 
-      NULL, NULL, TNC_MSG_INFO|TNC_MSG_EXIT,
+      NULL, NULL, opts.tnc_messages,
       maxCGit, maxnfeval, eta, stepmx, accuracy, fmin, ftol, xtol, pgtol,
-      rescale, &nfeval, &niter, NULL);
+      rescale, &nfeval, &niter, NULL,
+      cfg.exact_hessp?hessp_tnc_cont_drw:NULL);
   
   f_old = f;
   num_old = pixon.compute_pixon_number();
-  pixon.compute_rm_pixon(x.data());
-  chisq_old = pixon.compute_chisquare(x.data());
+  pixon.evaluate(x.data(), false);
+  chisq_old = pixon.chisq;
   memcpy(x_old.data(), x.data(), ndim*sizeof(double));
-  cout<<f_old<<"  "<<num_old<<"  "<<chisq_old<<endl;
+  pixon_log()<<f_old<<"  "<<num_old<<"  "<<chisq_old<<endl;
 
   /* then pixel-dependent pixon size */
   iter = 0;
   do
   {
     iter++;
-    cout<<"===================iter:"<<iter<<"==================="<<endl;
+    pixon_log()<<"===================iter:"<<iter<<"==================="<<endl;
 
     flag = pixon.update_pixon_map();
     if(!flag)
@@ -278,13 +305,14 @@ void run_drw(Data& cont_data, Data& cont_recon, Data& line, double *pimg, int np
 
     opt0.optimize(x, f);
     rc = tnc(ndim, x.data(), &f, g.data(), func_tnc_cont_drw, args, low.data(), up.data(), 
-      NULL, NULL, TNC_MSG_INFO|TNC_MSG_EXIT,
+      NULL, NULL, opts.tnc_messages,
       maxCGit, maxnfeval, eta, stepmx, accuracy, fmin, ftol, xtol, pgtol,
-      rescale, &nfeval, &niter, NULL);
+      rescale, &nfeval, &niter, NULL,
+      cfg.exact_hessp?hessp_tnc_cont_drw:NULL);
     
-    pixon.compute_rm_pixon(x.data());
-    chisq = pixon.compute_chisquare(x.data());
-    cout<<f<<"  "<<num<<"  "<<chisq<<endl;
+    pixon.evaluate(x.data(), false);
+    chisq = pixon.chisq;
+    pixon_log()<<f<<"  "<<num<<"  "<<chisq<<endl;
 
     if(f <= pixon.line.size)
     {
@@ -296,10 +324,12 @@ void run_drw(Data& cont_data, Data& cont_recon, Data& line, double *pimg, int np
     f_old = f;
     chisq_old = chisq;
     memcpy(x_old.data(), x.data(), ndim*sizeof(double));
-  }while(pixon.pfft.get_ipxion_min() >= pixon_map_low_bound); 
+  }while(pixon.pfft.get_ipxion_min() >= ctx.pixon_map_low_bound); 
 
-  cout<<"bg: "<<x_old[npixel]<<endl;
-  pixon.compute_rm_pixon(x_old.data());
+  pixon_log()<<"bg: "<<x_old[npixel]<<endl;
+  if(opts.precision_report)
+    report_fft_precision(pixon, func_tnc_cont_drw, x_old.data(), ndim, args);
+  pixon.evaluate(x_old.data(), false);
   ofstream fout;
   string fname;
   fname = "data/resp_drw.txt_" + to_string(cfg.pixon_basis_type);
@@ -345,14 +375,15 @@ void run_drw(Data& cont_data, Data& cont_recon, Data& line, double *pimg, int np
 }
 
 void run_drw_uniform(Data& cont_data, Data& cont_recon, Data& line, double *pimg, int npixel, 
-                  int& npixon_size, int ipositive_tau, double sigmad, double taud, double syserr, Config& cfg)
+                  int& npixon_size, int ipositive_tau, double sigmad, double taud, double syserr, Config& cfg, const PixonContext& ctx,
+                  const RunOptions& opts)
 {
-  cout<<"************************************************************"<<endl;
-  cout<<"Start run_drw_uniform..."<<endl;
-  cout<<"npixon_size:"<<npixon_size<<endl;
+  pixon_log()<<"************************************************************"<<endl;
+  pixon_log()<<"Start run_drw_uniform..."<<endl;
+  pixon_log()<<"npixon_size:"<<npixon_size<<endl;
   int i, iter;
   bool flag;
-  PixonDRW pixon(cont_data, cont_recon, line, npixel, npixon_size, sigmad, taud, syserr, ipositive_tau, cfg.sensitivity);
+  PixonDRW pixon(ctx, cont_data, cont_recon, line, npixel, npixon_size, sigmad, taud, syserr, ipositive_tau, cfg.sensitivity, cfg.adjoint_grad);
   void *args = (void *)&pixon;
   double f, f_old, num, num_old, chisq, chisq_old, df, dnum;
 
@@ -403,24 +434,25 @@ void run_drw_uniform(Data& cont_data, Data& cont_recon, Data& line, double *pimg
   
   opt0.optimize(x, f);
   rc = tnc(ndim, x.data(), &f, g.data(), func_tnc_cont_drw, args, low.data(), up.data(), 
-      NULL, NULL, TNC_MSG_INFO|TNC_MSG_EXIT,
+      NULL, NULL, opts.tnc_messages,
       maxCGit, maxnfeval, eta, stepmx, accuracy, fmin, ftol, xtol, pgtol,
-      rescale, &nfeval, &niter, NULL);
+      rescale, &nfeval, &niter, NULL,
+      cfg.exact_hessp?hessp_tnc_cont_drw:NULL);
   
   f_old = f;
   num_old = pixon.compute_pixon_number();
-  pixon.compute_rm_pixon(x.data());
-  chisq_old = pixon.compute_chisquare(x.data());
+  pixon.evaluate(x.data(), false);
+  chisq_old = pixon.chisq;
   memcpy(x_old.data(), x.data(), ndim*sizeof(double));
-  cout<<f_old<<"  "<<num_old<<"  "<<chisq_old<<endl;
+  pixon_log()<<f_old<<"  "<<num_old<<"  "<<chisq_old<<endl;
 
   iter = 0;
-  while(npixon_size>pixon_map_low_bound+1)
+  while(npixon_size>ctx.pixon_map_low_bound+1)
   {
     iter++;
-    cout<<"===================iter:"<<iter<<"==================="<<endl;
+    pixon_log()<<"===================iter:"<<iter<<"==================="<<endl;
     npixon_size--;
-    cout<<"npixon_size:"<<npixon_size<<",  size: "<<pixon.pfft.pixon_sizes[npixon_size-1]<<endl;
+    pixon_log()<<"npixon_size:"<<npixon_size<<",  size: "<<pixon.pfft.pixon_sizes[npixon_size-1]<<endl;
 
     pixon.reduce_pixon_map_all();
     num = pixon.compute_pixon_number();
@@ -435,13 +467,14 @@ void run_drw_uniform(Data& cont_data, Data& cont_recon, Data& line, double *pimg
 
     opt0.optimize(x, f);
     rc = tnc(ndim, x.data(), &f, g.data(), func_tnc_cont_drw, args, low.data(), up.data(), 
-      NULL, NULL, TNC_MSG_INFO|TNC_MSG_EXIT,
+      NULL, NULL, opts.tnc_messages,
       maxCGit, maxnfeval, eta, stepmx, accuracy, fmin, ftol, xtol, pgtol,
-      rescale, &nfeval, &niter, NULL);
+      rescale, &nfeval, &niter, NULL,
+      cfg.exact_hessp?hessp_tnc_cont_drw:NULL);
     
-    pixon.compute_rm_pixon(x.data());
-    chisq = pixon.compute_chisquare(x.data());
-    cout<<f<<"  "<<num<<"  "<<chisq<<endl;
+    pixon.evaluate(x.data(), false);
+    chisq = pixon.chisq;
+    pixon_log()<<f<<"  "<<num<<"  "<<chisq<<endl;
 
     if(f <= fmin)
     {
@@ -465,8 +498,10 @@ void run_drw_uniform(Data& cont_data, Data& cont_recon, Data& line, double *pimg
     memcpy(x_old.data(), x.data(), ndim*sizeof(double));
   }
 
-  cout<<"bg: "<<x_old[npixel]<<endl;
-  pixon.compute_rm_pixon(x_old.data());
+  pixon_log()<<"bg: "<<x_old[npixel]<<endl;
+  if(opts.precision_report)
+    report_fft_precision(pixon, func_tnc_cont_drw, x_old.data(), ndim, args);
+  pixon.evaluate(x_old.data(), false);
   ofstream fout;
   string fname;
   fname = "data/resp_drw_uniform.txt_" + to_string(cfg.pixon_basis_type);
@@ -514,15 +549,16 @@ void run_drw_uniform(Data& cont_data, Data& cont_recon, Data& line, double *pimg
 
 /* set continuum free and use pixons to model continuum, pixel-dependent pixon sizes for RM */
 void run_pixon(Data& cont_data, Data& cont_recon, Data& line, double *pimg, int npixel, 
-                    int& npixon_size, int ipositive_tau, Config& cfg)
+                    int& npixon_size, int ipositive_tau, Config& cfg, const PixonContext& ctx,
+                    const RunOptions& opts)
 {
-  cout<<"************************************************************"<<endl;
-  cout<<"Start run_pixon..."<<endl;
-  cout<<"npixon_size:"<<npixon_size<<endl;
+  pixon_log()<<"************************************************************"<<endl;
+  pixon_log()<<"Start run_pixon..."<<endl;
+  pixon_log()<<"npixon_size:"<<npixon_size<<endl;
   bool flag;
   int i, iter;
-  int npixon_size_cont = 10;
-  PixonCont pixon(cont_data, cont_recon, line, npixel, npixon_size, npixon_size_cont, ipositive_tau, cfg.sensitivity);
+  int npixon_size_cont = NPIXON_SIZE_CONT;
+  PixonCont pixon(ctx, cont_data, cont_recon, line, npixel, npixon_size, npixon_size_cont, ipositive_tau, cfg.sensitivity, cfg.adjoint_grad);
   void *args = (void *)&pixon;
   double f, f_old, num, num_old, chisq, chisq_old, df, dnum;
 
@@ -553,21 +589,22 @@ void run_pixon(Data& cont_data, Data& cont_recon, Data& line, double *pimg, int
   
   opt0.optimize(x_cont, f);
   rc = tnc(cont_recon.size, x_cont.data(), &f, g_cont.data(), func_tnc_cont, args, 
-      low_cont.data(), up_cont.data(), NULL, NULL, TNC_MSG_INFO|TNC_MSG_EXIT,
+      low_cont.data(), up_cont.data(), NULL, NULL, opts.tnc_messages,
       maxCGit, maxnfeval, eta, stepmx, accuracy, fmin, ftol, xtol, pgtol,
-      rescale, &nfeval, &niter, NULL);
+      rescale, &nfeval, &niter, NULL,
+      cfg.exact_hessp?hessp_tnc_cont:NULL);
   
   f_old = f;
   num_old = pixon.compute_pixon_number_cont();
   pixon.compute_cont(x_cont.data());
   chisq_old = pixon.compute_chisquare_cont(x_cont.data());
   memcpy(x_old_cont.data(), x_cont.data(), cont_recon.size*sizeof(double));
-  cout<<f_old<<"  "<<num_old<<"  "<<chisq_old<<endl;
+  pixon_log()<<f_old<<"  "<<num_old<<"  "<<chisq_old<<endl;
  
   while(npixon_size_cont>2)
   {
     npixon_size_cont--;
-    cout<<"npixon_size_cont:"<<npixon_size_cont<<",  size: "<<pixon.pfft_cont.pixon_sizes[npixon_size_cont-1]<<endl;
+    pixon_log()<<"npixon_size_cont:"<<npixon_size_cont<<",  size: "<<pixon.pfft_cont.pixon_sizes[npixon_size_cont-1]<<endl;
     
     pixon.reduce_ipixon_cont();
     num = pixon.compute_pixon_number_cont();
@@ -582,13 +619,14 @@ void run_pixon(Data& cont_data, Data& cont_recon, Data& line, double *pimg, int
 
     opt0.optimize(x_cont, f);
     rc = tnc(cont_recon.size, x_cont.data(), &f, g_cont.data(), func_tnc_cont, args, 
-      low_cont.data(), up_cont.data(), NULL, NULL, TNC_MSG_INFO|TNC_MSG_EXIT,
+      low_cont.data(), up_cont.data(), NULL, NULL, opts.tnc_messages,
       maxCGit, maxnfeval, eta, stepmx, accuracy, fmin, ftol, xtol, pgtol,
-      rescale, &nfeval, &niter, NULL);
+      rescale, &nfeval, &niter, NULL,
+      cfg.exact_hessp?hessp_tnc_cont:NULL);
     
     pixon.compute_cont(x_cont.data());
     chisq = pixon.compute_chisquare_cont(x_cont.data());
-    cout<<f<<"  "<<num<<"  "<<chisq<<endl;
+    pixon_log()<<f<<"  "<<num<<"  "<<chisq<<endl;
 
     if(f <= fmin)
     {
@@ -620,7 +658,7 @@ void run_pixon(Data& cont_data, Data& cont_recon, Data& line, double *pimg, int
   }
   fp.close();
 
-  cout<<"Start to RM"<<endl;
+  pixon_log()<<"Start to RM"<<endl;
   /* then continuum and line reverberation */
   pixon.cont.set_data(pixon.image_cont);
   /* TNC */
@@ -677,23 +715,24 @@ void run_pixon(Data& cont_data, Data& cont_recon, Data& line, double *pimg, int
 
   opt1.optimize(x, f);
   rc = tnc(ndim, x.data(), &f, g.data(), func_tnc_cont_rm, args, low.data(), up.data(), 
-      NULL, NULL, TNC_MSG_INFO|TNC_MSG_EXIT,
+      NULL, NULL, opts.tnc_messages,
       maxCGit, maxnfeval, eta, stepmx, accuracy, fmin, ftol, xtol, pgtol,
-      rescale, &nfeval, &niter, NULL);
+      rescale, &nfeval, &niter, NULL,
+      cfg.exact_hessp?hessp_tnc_cont_rm:NULL);
     
   f_old = f;
   num_old = pixon.compute_pixon_number();
-  pixon.compute_rm_pixon(x.data());
-  chisq_old = pixon.compute_chisquare(x.data());
+  pixon.evaluate(x.data(), false);
+  chisq_old = pixon.chisq;
   memcpy(x_old.data(), x.data(), ndim*sizeof(double));
-  cout<<f_old<<"  "<<num_old<<"  "<<chisq_old<<endl;
+  pixon_log()<<f_old<<"  "<<num_old<<"  "<<chisq_old<<endl;
   
   /* then pixel-dependent pixon size */
   iter = 0;
   do
   {
     iter++;
-    cout<<"===================iter:"<<iter<<"==================="<<endl;
+    pixon_log()<<"===================iter:"<<iter<<"==================="<<endl;
     
     flag = pixon.update_pixon_map();
     if(!flag)
@@ -711,13 +750,14 @@ void run_pixon(Data& cont_data, Data& cont_recon, Data& line, double *pimg, int
 
     opt1.optimize(x, f);
     rc = tnc(ndim, x.data(), &f, g.data(), func_tnc_cont_rm, args, low.data(), up.data(), 
-      NULL, NULL, TNC_MSG_INFO|TNC_MSG_EXIT,
+      NULL, NULL, opts.tnc_messages,
       maxCGit, maxnfeval, eta, stepmx, accuracy, fmin, ftol, xtol, pgtol,
-      rescale, &nfeval, &niter, NULL);
+      rescale, &nfeval, &niter, NULL,
+      cfg.exact_hessp?hessp_tnc_cont_rm:NULL);
     
-    pixon.compute_rm_pixon(x.data());
-    chisq = pixon.compute_chisquare(x.data());
-    cout<<f<<"  "<<num<<"  "<<chisq<<endl;
+    pixon.evaluate(x.data(), false);
+    chisq = pixon.chisq;
+    pixon_log()<<f<<"  "<<num<<"  "<<chisq<<endl;
 
     if(f <= fmin)
     {
@@ -729,10 +769,12 @@ void run_pixon(Data& cont_data, Data& cont_recon, Data& line, double *pimg, int
     f_old = f;
     chisq_old = chisq;
     memcpy(x_old.data(), x.data(), ndim*sizeof(double));
-  }while(pixon.pfft.get_ipxion_min() >= pixon_map_low_bound); 
+  }while(pixon.pfft.get_ipxion_min() >= ctx.pixon_map_low_bound); 
   
-  cout<<"bg: "<<x_old[npixel]<<endl;
-  pixon.compute_rm_pixon(x_old.data());
+  pixon_log()<<"bg: "<<x_old[npixel]<<endl;
+  if(opts.precision_report)
+    report_fft_precision(pixon, func_tnc_cont_rm, x_old.data(), ndim, args);
+  pixon.evaluate(x_old.data(), false);
   ofstream fout;
   string fname;
   fname = "data/resp_pixon.txt_" + to_string(cfg.pixon_basis_type);
@@ -780,14 +822,15 @@ void run_pixon(Data& cont_data, Data& cont_recon, Data& line, double *pimg, int
 
 /* set continuum free and use pixons to model continuum, uniform pixon sizes for RM */
 void run_pixon_uniform(Data& cont_data, Data& cont_recon, Data& line, double *pimg, 
-                            int npixel, int& npixon_size, int ipositive_tau, Config& cfg)
+                            int npixel, int& npixon_size, int ipositive_tau, Config& cfg, const PixonContext& ctx,
+                            const RunOptions& opts)
 {
-  cout<<"************************************************************"<<endl;
-  cout<<"Start run_pixon_uniform..."<<endl;
-  cout<<"npixon_size:"<<npixon_size<<endl;
+  pixon_log()<<"************************************************************"<<endl;
+  pixon_log()<<"Start run_pixon_uniform..."<<endl;
+  pixon_log()<<"npixon_size:"<<npixon_size<<endl;
   int i, iter;
-  int npixon_size_cont = 10;
-  PixonCont pixon(cont_data, cont_recon, line, npixel, npixon_size, npixon_size_cont, ipositive_tau, cfg.sensitivity);
+  int npixon_size_cont = NPIXON_SIZE_CONT;
+  PixonCont pixon(ctx, cont_data, cont_recon, line, npixel, npixon_size, npixon_size_cont, ipositive_tau, cfg.sensitivity, cfg.adjoint_grad);
   void *args = (void *)&pixon;
   double f, f_old, num, num_old, chisq, chisq_old, df, dnum;
 
@@ -818,21 +861,22 @@ void run_pixon_uniform(Data& cont_data, Data& cont_recon, Data& line, double *pi
   
   opt0.optimize(x_cont, f);
   rc = tnc(cont_recon.size, x_cont.data(), &f, g_cont.data(), func_tnc_cont, args, 
-      low_cont.data(), up_cont.data(), NULL, NULL, TNC_MSG_INFO|TNC_MSG_EXIT,
+      low_cont.data(), up_cont.data(), NULL, NULL, opts.tnc_messages,
       maxCGit, maxnfeval, eta, stepmx, accuracy, fmin, ftol, xtol, pgtol,
-      rescale, &nfeval, &niter, NULL);
+      rescale, &nfeval, &niter, NULL,
+      cfg.exact_hessp?hessp_tnc_cont:NULL);
   
   f_old = f;
   num_old = pixon.compute_pixon_number_cont();
   pixon.compute_cont(x_cont.data());
   chisq_old = pixon.compute_chisquare_cont(x_cont.data());
   memcpy(x_old_cont.data(), x_cont.data(), cont_recon.size*sizeof(double));
-  cout<<f_old<<"  "<<num_old<<"  "<<chisq_old<<endl;
+  pixon_log()<<f_old<<"  "<<num_old<<"  "<<chisq_old<<endl;
  
   while(npixon_size_cont>2)
   {
     npixon_size_cont--;
-    cout<<"npixon_size_cont:"<<npixon_size_cont<<",  size: "<<pixon.pfft_cont.pixon_sizes[npixon_size_cont-1]<<endl;
+    pixon_log()<<"npixon_size_cont:"<<npixon_size_cont<<",  size: "<<pixon.pfft_cont.pixon_sizes[npixon_size_cont-1]<<endl;
     
     pixon.reduce_ipixon_cont();
     num = pixon.compute_pixon_number_cont();
@@ -847,13 +891,14 @@ void run_pixon_uniform(Data& cont_data, Data& cont_recon, Data& line, double *pi
 
     opt0.optimize(x_cont, f);
     rc = tnc(cont_recon.size, x_cont.data(), &f, g_cont.data(), func_tnc_cont, args, 
-      low_cont.data(), up_cont.data(), NULL, NULL, TNC_MSG_INFO|TNC_MSG_EXIT,
+      low_cont.data(), up_cont.data(), NULL, NULL, opts.tnc_messages,
       maxCGit, maxnfeval, eta, stepmx, accuracy, fmin, ftol, xtol, pgtol,
-      rescale, &nfeval, &niter, NULL);
+      rescale, &nfeval, &niter, NULL,
+      cfg.exact_hessp?hessp_tnc_cont:NULL);
     
     pixon.compute_cont(x_cont.data());
     chisq = pixon.compute_chisquare_cont(x_cont.data());
-    cout<<f<<"  "<<num<<"  "<<chisq<<endl;
+    pixon_log()<<f<<"  "<<num<<"  "<<chisq<<endl;
 
     if(f <= fmin)
     {
@@ -885,7 +930,7 @@ void run_pixon_uniform(Data& cont_data, Data& cont_recon, Data& line, double *pi
   }
   fp.close();
 
-  cout<<"Start to RM"<<endl;
+  pixon_log()<<"Start to RM"<<endl;
   /* then continuum and line reverberation */
   pixon.cont.set_data(pixon.image_cont);
   /* TNC */
@@ -942,24 +987,25 @@ void run_pixon_uniform(Data& cont_data, Data& cont_recon, Data& line, double *pi
 
   opt1.optimize(x, f);
   rc = tnc(ndim, x.data(), &f, g.data(), func_tnc_cont_rm, args, low.data(), up.data(), 
-      NULL, NULL, TNC_MSG_INFO|TNC_MSG_EXIT,
+      NULL, NULL, opts.tnc_messages,
       maxCGit, maxnfeval, eta, stepmx, accuracy, fmin, ftol, xtol, pgtol,
-      rescale, &nfeval, &niter, NULL);
+      rescale, &nfeval, &niter, NULL,
+      cfg.exact_hessp?hessp_tnc_cont_rm:NULL);
     
   f_old = f;
   num_old = pixon.compute_pixon_number();
-  pixon.compute_rm_pixon(x.data());
-  chisq_old = pixon.compute_chisquare(x.data());
+  pixon.evaluate(x.data(), false);
+  chisq_old = pixon.chisq;
   memcpy(x_old.data(), x.data(), ndim*sizeof(double));
-  cout<<f_old<<"  "<<num_old<<"  "<<chisq_old<<endl;
+  pixon_log()<<f_old<<"  "<<num_old<<"  "<<chisq_old<<endl;
   
   iter = 0;
-  while(npixon_size>pixon_map_low_bound+1)
+  while(npixon_size>ctx.pixon_map_low_bound+1)
   {
     iter++;
-    cout<<"===================iter:"<<iter<<"==================="<<endl;
+    pixon_log()<<"===================iter:"<<iter<<"==================="<<endl;
     npixon_size--;
-    cout<<"npixon_size:"<<npixon_size<<",  size: "<<pixon.pfft.pixon_sizes[npixon_size-1]<<endl;
+    pixon_log()<<"npixon_size:"<<npixon_size<<",  size: "<<pixon.pfft.pixon_sizes[npixon_size-1]<<endl;
 
     pixon.reduce_pixon_map_all();
     num = pixon.compute_pixon_number();
@@ -974,13 +1020,14 @@ void run_pixon_uniform(Data& cont_data, Data& cont_recon, Data& line, double *pi
 
     opt1.optimize(x, f);
     rc = tnc(ndim, x.data(), &f, g.data(), func_tnc_cont_rm, args, low.data(), up.data(), 
-      NULL, NULL, TNC_MSG_INFO|TNC_MSG_EXIT,
+      NULL, NULL, opts.tnc_messages,
       maxCGit, maxnfeval, eta, stepmx, accuracy, fmin, ftol, xtol, pgtol,
-      rescale, &nfeval, &niter, NULL);
+      rescale, &nfeval, &niter, NULL,
+      cfg.exact_hessp?hessp_tnc_cont_rm:NULL);
     
-    pixon.compute_rm_pixon(x.data());
-    chisq = pixon.compute_chisquare(x.data());
-    cout<<f<<"  "<<num<<"  "<<chisq<<endl;
+    pixon.evaluate(x.data(), false);
+    chisq = pixon.chisq;
+    pixon_log()<<f<<"  "<<num<<"  "<<chisq<<endl;
 
     if(f <= fmin)
     {
@@ -1004,8 +1051,10 @@ void run_pixon_uniform(Data& cont_data, Data& cont_recon, Data& line, double *pi
     memcpy(x_old.data(), x.data(), ndim*sizeof(double));
   }
   
-  cout<<"bg: "<<x_old[npixel]<<endl;
-  pixon.compute_rm_pixon(x_old.data());
+  pixon_log()<<"bg: "<<x_old[npixel]<<endl;
+  if(opts.precision_report)
+    report_fft_precision(pixon, func_tnc_cont_rm, x_old.data(), ndim, args);
+  pixon.evaluate(x_old.data(), false);
   ofstream fout;
   string fname;
   fname = "data/resp_pixon_uniform.txt_" + to_string(cfg.pixon_basis_type);
@@ -1052,13 +1101,14 @@ void run_pixon_uniform(Data& cont_data, Data& cont_recon, Data& line, double *pi
 }
 
 /* set continuum fixed from a drw reconstruction and use pixel dependent pixon sizes for RM */
-void run_contfix(Data& cont, Data& line, double *pimg, int npixel, int& npixon_size, int ipositive_tau, Config& cfg)
+void run_contfix(Data& cont, Data& line, double *pimg, int npixel, int& npixon_size, int ipositive_tau, Config& cfg, const PixonContext& ctx,
+                 const RunOptions& opts)
 {
-  cout<<"************************************************************"<<endl;
-  cout<<"Start run_contfix..."<<endl;
-  cout<<"npixon_size:"<<npixon_size<<endl;
+  pixon_log()<<"************************************************************"<<endl;
+  pixon_log()<<"Start run_contfix..."<<endl;
+  pixon_log()<<"npixon_size:"<<npixon_size<<endl;
   int i, iter;
-  Pixon pixon(cont, line, npixel, npixon_size, ipositive_tau, cfg.sensitivity);
+  Pixon pixon(ctx, cont, line, npixel, npixon_size, ipositive_tau, cfg.sensitivity, cfg.adjoint_grad);
   void *args = (void *)&pixon;
   bool flag;
   double f, f_old, num, num_old, chisq, chisq_old, df, dnum;
@@ -1103,23 +1153,24 @@ void run_contfix(Data& cont, Data& line, double *pimg, int npixel, int& npixon_s
   
   opt0.optimize(x, f);
   rc = tnc(ndim, x.data(), &f, g.data(), func_tnc, args, low.data(), up.data(), 
-      NULL, NULL, TNC_MSG_INFO|TNC_MSG_EXIT,
+      NULL, NULL, opts.tnc_messages,
       maxCGit, maxnfeval, eta, stepmx, accuracy, fmin, ftol, xtol, pgtol,
-      rescale, &nfeval, &niter, NULL);
+      rescale, &nfeval, &niter, NULL,
+      cfg.exact_hessp?hessp_tnc:NULL);
   
   f_old = f;
   num_old = pixon.compute_pixon_number();
-  pixon.compute_rm_pixon(x.data());
-  chisq_old = pixon.compute_chisquare(x.data());
+  pixon.evaluate(x.data(), false);
+  chisq_old = pixon.chisq;
   memcpy(x_old.data(), x.data(), ndim*sizeof(double));
-  cout<<f_old<<"  "<<num_old<<"  "<<chisq_old<<endl;
+  pixon_log()<<f_old<<"  "<<num_old<<"  "<<chisq_old<<endl;
 
   /* then pixel-dependent pixon size */
   iter = 0;
   do
   {
     iter++;
-    cout<<"===================iter:"<<iter<<"==================="<<endl;
+    pixon_log()<<"===================iter:"<<iter<<"==================="<<endl;
     
     flag = pixon.update_pixon_map();
     if(!flag)
@@ -1137,13 +1188,14 @@ void run_contfix(Data& cont, Data& line, double *pimg, int npixel, int& npixon_s
 
     opt0.optimize(x, f);
     rc = tnc(ndim, x.data(), &f, g.data(), func_tnc, args, low.data(), up.data(), 
-      NULL, NULL, TNC_MSG_INFO|TNC_MSG_EXIT,
+      NULL, NULL, opts.tnc_messages,
       maxCGit, maxnfeval, eta, stepmx, accuracy, fmin, ftol, xtol, pgtol,
-      rescale, &nfeval, &niter, NULL);
+      rescale, &nfeval, &niter, NULL,
+      cfg.exact_hessp?hessp_tnc:NULL);
     
-    pixon.compute_rm_pixon(x.data());
-    chisq = pixon.compute_chisquare(x.data());
-    cout<<f<<"  "<<num<<"  "<<chisq<<endl;
+    pixon.evaluate(x.data(), false);
+    chisq = pixon.chisq;
+    pixon_log()<<f<<"  "<<num<<"  "<<chisq<<endl;
 
     if(f <= pixon.line.size)
     {
@@ -1158,11 +1210,13 @@ void run_contfix(Data& cont, Data& line, double *pimg, int npixel, int& npixon_s
     f_old = f;
     chisq_old = chisq;
     memcpy(x_old.data(), x.data(), ndim*sizeof(double));
-  }while(pixon.pfft.get_ipxion_min() >= pixon_map_low_bound); 
+  }while(pixon.pfft.get_ipxion_min() >= ctx.pixon_map_low_bound); 
 
-  cout<<"bg: "<<x_old[npixel]<<endl;
+  pixon_log()<<"bg: "<<x_old[npixel]<<endl;
+  if(opts.precision_report)
+    report_fft_precision(pixon, func_tnc, x_old.data(), ndim, args);
   
-  pixon.compute_rm_pixon(x_old.data());
+  pixon.evaluate(x_old.data(), false);
   ofstream fout;
   string fname;
   fname = "data/resp_contfix.txt_" + to_string(cfg.pixon_basis_type);
@@ -1201,13 +1255,14 @@ void run_contfix(Data& cont, Data& line, double *pimg, int npixel, int& npixon_s
 }
 
 /* set continuum fixed from a drw reconstruction and use uniform pixon sizes for RM */
-void run_contfix_uniform(Data& cont, Data& line, double *pimg, int npixel, int& npixon_size, int ipositive_tau, Config& cfg)
+void run_contfix_uniform(Data& cont, Data& line, double *pimg, int npixel, int& npixon_size, int ipositive_tau, Config& cfg, const PixonContext& ctx,
+                         const RunOptions& opts)
 {
-  cout<<"************************************************************"<<endl;
-  cout<<"Start run_contfix_uniform..."<<endl;
-  cout<<"npixon_size:"<<npixon_size<<endl;
+  pixon_log()<<"************************************************************"<<endl;
+  pixon_log()<<"Start run_contfix_uniform..."<<endl;
+  pixon_log()<<"npixon_size:"<<npixon_size<<endl;
   int i;
-  Pixon pixon(cont, line, npixel, npixon_size, ipositive_tau, cfg.sensitivity);
+  Pixon pixon(ctx, cont, line, npixel, npixon_size, ipositive_tau, cfg.sensitivity, cfg.adjoint_grad);
   void *args = (void *)&pixon;
   double f, f_old, num_old, num, df, dnum, chisq, chisq_old;
   int iter;
@@ -1253,24 +1308,25 @@ void run_contfix_uniform(Data& cont, Data& line, double *pimg, int npixel, int&
    
   opt0.optimize(x, f);
   rc = tnc(ndim, x.data(), &f, g.data(), func_tnc, args, low.data(), up.data(), 
-      NULL, NULL, TNC_MSG_INFO|TNC_MSG_EXIT,
+      NULL, NULL, opts.tnc_messages,
       maxCGit, maxnfeval, eta, stepmx, accuracy, fmin, ftol, xtol, pgtol,
-      rescale, &nfeval, &niter, NULL);
+      rescale, &nfeval, &niter, NULL,
+      cfg.exact_hessp?hessp_tnc:NULL);
   
   f_old = f;
   num_old = pixon.compute_pixon_number();
-  pixon.compute_rm_pixon(x.data());
-  chisq_old = pixon.compute_chisquare(x.data());
+  pixon.evaluate(x.data(), false);
+  chisq_old = pixon.chisq;
   memcpy(x_old.data(), x.data(), ndim*sizeof(double));
-  cout<<f_old<<"  "<<num_old<<"  "<<chisq_old<<endl;
+  pixon_log()<<f_old<<"  "<<num_old<<"  "<<chisq_old<<endl;
 
   iter = 0;
-  while(npixon_size>pixon_map_low_bound+1)
+  while(npixon_size>ctx.pixon_map_low_bound+1)
   {
     iter++;
-    cout<<"===================iter:"<<iter<<"==================="<<endl;
+    pixon_log()<<"===================iter:"<<iter<<"==================="<<endl;
     npixon_size--;
-    cout<<"npixon_size:"<<npixon_size<<",  size: "<<pixon.pfft.pixon_sizes[npixon_size-1]<<endl;
+    pixon_log()<<"npixon_size:"<<npixon_size<<",  size: "<<pixon.pfft.pixon_sizes[npixon_size-1]<<endl;
 
     pixon.reduce_pixon_map_all();
     num = pixon.compute_pixon_number();
@@ -1285,13 +1341,14 @@ void run_contfix_uniform(Data& cont, Data& line, double *pimg, int npixel, int&
 
     opt0.optimize(x, f);
     rc = tnc(ndim, x.data(), &f, g.data(), func_tnc, args, low.data(), up.data(), 
-      NULL, NULL, TNC_MSG_INFO|TNC_MSG_EXIT,
+      NULL, NULL, opts.tnc_messages,
       maxCGit, maxnfeval, eta, stepmx, accuracy, fmin, ftol, xtol, pgtol,
-      rescale, &nfeval, &niter, NULL);
+      rescale, &nfeval, &niter, NULL,
+      cfg.exact_hessp?hessp_tnc:NULL);
     
-    pixon.compute_rm_pixon(x.data());
-    chisq = pixon.compute_chisquare(x.data());
-    cout<<f<<"  "<<num<<"  "<<chisq<<endl;
+    pixon.evaluate(x.data(), false);
+    chisq = pixon.chisq;
+    pixon_log()<<f<<"  "<<num<<"  "<<chisq<<endl;
 
     if(f <= pixon.line.size)
     {
@@ -1315,9 +1372,11 @@ void run_contfix_uniform(Data& cont, Data& line, double *pimg, int npixel, int&
     memcpy(x_old.data(), x.data(), ndim*sizeof(double));
   }
   
-  cout<<"bg: "<<x_old[npixel]<<endl;
+  pixon_log()<<"bg: "<<x_old[npixel]<<endl;
+  if(opts.precision_report)
+    report_fft_precision(pixon, func_tnc, x_old.data(), ndim, args);
   
-  pixon.compute_rm_pixon(x_old.data());
+  pixon.evaluate(x_old.data(), false);
   ofstream fout;
   string fname;
   fname = "data/resp_contfix_uniform.txt_" + to_string(cfg.pixon_basis_type);
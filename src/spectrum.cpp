@@ -0,0 +1,305 @@
+/*
+ *  PIXON
+ *  A Pixon-based method for reconstructing velocity-delay map in reverberation mapping.
+ *
+ *  Yan-Rong Li, liyanrong@mail.ihep.ac.cn
+ *
+ */
+#include <iostream>
+#include <cstring>
+#include <cmath>
+#include <atomic>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define SPECTRUM_X86
+#endif
+
+#include "spectrum.hpp"
+
+using namespace std;
+
+/*==================================================================*/
+/* scalar kernels, also used for the tails of the vectorized ones */
+static void mul_scalar(const fft_complex *a, const fft_complex *b, double scale, fft_complex *out, int n)
+{
+  int i;
+  fft_real re, im;
+  for(i=0; i<n; i++)
+  {
+    re = a[i][0]*b[i][0] - a[i][1]*b[i][1];
+    im = a[i][0]*b[i][1] + a[i][1]*b[i][0];
+    out[i][0] = re * scale;
+    out[i][1] = im * scale;
+  }
+}
+
+static void mul_conj_scalar(const fft_complex *a, const fft_complex *b, double scale, fft_complex *out, int n)
+{
+  int i;
+  fft_real re, im;
+  for(i=0; i<n; i++)
+  {
+    re = a[i][0]*b[i][0] + a[i][1]*b[i][1];
+    im = a[i][1]*b[i][0] - a[i][0]*b[i][1];
+    out[i][0] = re * scale;
+    out[i][1] = im * scale;
+  }
+}
+
+static void mul_sum_scalar(const fft_complex * const *a, const fft_complex * const *b, const double *scale, int nk,
+                           fft_complex *out, int n, int i0)
+{
+  int i, k;
+  fft_real re, im;
+  for(i=i0; i<n; i++)
+  {
+    re = im = 0.0;
+    for(k=0; k<nk; k++)
+    {
+      re += (a[k][i][0]*b[k][i][0] - a[k][i][1]*b[k][i][1]) * scale[k];
+      im += (a[k][i][0]*b[k][i][1] + a[k][i][1]*b[k][i][0]) * scale[k];
+    }
+    out[i][0] = re;
+    out[i][1] = im;
+  }
+}
+
+static void mul_sum_scalar(const fft_complex * const *a, const fft_complex * const *b, const double *scale, int nk,
+                           fft_complex *out, int n)
+{
+  mul_sum_scalar(a, b, scale, nk, out, n, 0);
+}
+
+static void scale_scalar(const fft_complex *a, double scale, fft_complex *out, int n)
+{
+  int i;
+  for(i=0; i<n; i++)
+  {
+    out[i][0] = a[i][0] * scale;
+    out[i][1] = a[i][1] * scale;
+  }
+}
+
+static void axpy_scalar(const fft_complex *a, double scale, fft_complex *out, int n)
+{
+  int i;
+  for(i=0; i<n; i++)
+  {
+    out[i][0] += a[i][0] * scale;
+    out[i][1] += a[i][1] * scale;
+  }
+}
+
+#ifdef SPECTRUM_X86
+/* 
+ * GCC 12 warns about the undefined upper lanes the intrinsic headers start from 
+ * in the AVX-512 permute and movedup, those lanes are all overwritten.
+ */
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wuninitialized"
+#pragma GCC diagnostic ignored "-Wmaybe-uninitialized"
+/*==================================================================*/
+/*
+ * vectorized kernels on interleaved (re, im) pairs.
+ * with b_re and b_im duplicated into both lanes of a pair and a with swapped lanes,
+ * a*b = fmaddsub(a, b_re, swap(a)*b_im) and a*conj(b) = fmsubadd(a, b_re, swap(a)*b_im).
+ * NC is the number of complex values per vector.
+ */
+#define SPECTRUM_KERNELS(ISA, TARGET, V, NC, LOAD, STORE, SET1, ZERO, MUL, FMADD, FMADDSUB, FMSUBADD, DUPRE, DUPIM, SWAP) \
+__attribute__((target(TARGET))) \
+static void mul_##ISA(const fft_complex *a, const fft_complex *b, double scale, fft_complex *out, int n) \
+{ \
+  const fft_real *pa = (const fft_real *)a, *pb = (const fft_real *)b; \
+  fft_real *po = (fft_real *)out; \
+  V s = SET1((fft_real)scale), va, vb; \
+  int i; \
+  for(i=0; i+NC<=n; i+=NC) \
+  { \
+    va = LOAD(pa + 2*i); \
+    vb = LOAD(pb + 2*i); \
+    STORE(po + 2*i, MUL(FMADDSUB(va, DUPRE(vb), MUL(SWAP(va), DUPIM(vb))), s)); \
+  } \
+  mul_scalar(a+i, b+i, scale, out+i, n-i); \
+} \
+__attribute__((target(TARGET))) \
+static void mul_conj_##ISA(const fft_complex *a, const fft_complex *b, double scale, fft_complex *out, int n) \
+{ \
+  const fft_real *pa = (const fft_real *)a, *pb = (const fft_real *)b; \
+  fft_real *po = (fft_real *)out; \
+  V s = SET1((fft_real)scale), va, vb; \
+  int i; \
+  for(i=0; i+NC<=n; i+=NC) \
+  { \
+    va = LOAD(pa + 2*i); \
+    vb = LOAD(pb + 2*i); \
+    STORE(po + 2*i, MUL(FMSUBADD(va, DUPRE(vb), MUL(SWAP(va), DUPIM(vb))), s)); \
+  } \
+  mul_conj_scalar(a+i, b+i, scale, out+i, n-i); \
+} \
+__attribute__((target(TARGET))) \
+static void mul_sum_##ISA(const fft_complex * const *a, const fft_complex * const *b, const double *scale, int nk, \
+                          fft_complex *out, int n) \
+{ \
+  fft_real *po = (fft_real *)out; \
+  V acc, va, vb; \
+  int i, k; \
+  for(i=0; i+NC<=n; i+=NC) \
+  { \
+    acc = ZERO(); \
+    for(k=0; k<nk; k++) \
+    { \
+      va = LOAD((const fft_real *)a[k] + 2*i); \
+      vb = LOAD((const fft_real *)b[k] + 2*i); \
+      acc = FMADD(FMADDSUB(va, DUPRE(vb), MUL(SWAP(va), DUPIM(vb))), SET1((fft_real)scale[k]), acc); \
+    } \
+    STORE(po + 2*i, acc); \
+  } \
+  mul_sum_scalar(a, b, scale, nk, out, n, i); \
+} \
+__attribute__((target(TARGET))) \
+static void scale_##ISA(const fft_complex *a, double scale, fft_complex *out, int n) \
+{ \
+  const fft_real *pa = (const fft_real *)a; \
+  fft_real *po = (fft_real *)out; \
+  V s = SET1((fft_real)scale); \
+  int i; \
+  for(i=0; i+NC<=n; i+=NC) \
+  { \
+    STORE(po + 2*i, MUL(LOAD(pa + 2*i), s)); \
+  } \
+  scale_scalar(a+i, scale, out+i, n-i); \
+} \
+__attribute__((target(TARGET))) \
+static void axpy_##ISA(const fft_complex *a, double scale, fft_complex *out, int n) \
+{ \
+  const fft_real *pa = (const fft_real *)a; \
+  fft_real *po = (fft_real *)out; \
+  V s = SET1((fft_real)scale); \
+  int i; \
+  for(i=0; i+NC<=n; i+=NC) \
+  { \
+    STORE(po + 2*i, FMADD(LOAD(pa + 2*i), s, LOAD(po + 2*i))); \
+  } \
+  axpy_scalar(a+i, scale, out+i, n-i); \
+}
+
+#ifdef PIXON_FFT_FLOAT
+#define DUPRE256(v) _mm256_moveldup_ps(v)
+#define DUPIM256(v) _mm256_movehdup_ps(v)
+#define SWAP256(v)  _mm256_permute_ps(v, 0xB1)
+#define DUPRE512(v) _mm512_moveldup_ps(v)
+#define DUPIM512(v) _mm512_movehdup_ps(v)
+#define SWAP512(v)  _mm512_permute_ps(v, 0xB1)
+SPECTRUM_KERNELS(avx2, "avx2,fma", __m256, 4, _mm256_loadu_ps, _mm256_storeu_ps, _mm256_set1_ps, _mm256_setzero_ps,
+                 _mm256_mul_ps, _mm256_fmadd_ps, _mm256_fmaddsub_ps, _mm256_fmsubadd_ps, DUPRE256, DUPIM256, SWAP256)
+SPECTRUM_KERNELS(avx512, "avx512f", __m512, 8, _mm512_loadu_ps, _mm512_storeu_ps, _mm512_set1_ps, _mm512_setzero_ps,
+                 _mm512_mul_ps, _mm512_fmadd_ps, _mm512_fmaddsub_ps, _mm512_fmsubadd_ps, DUPRE512, DUPIM512, SWAP512)
+#else
+#define DUPRE256(v) _mm256_movedup_pd(v)
+#define DUPIM256(v) _mm256_permute_pd(v, 0xF)
+#define SWAP256(v)  _mm256_permute_pd(v, 0x5)
+#define DUPRE512(v) _mm512_movedup_pd(v)
+#define DUPIM512(v) _mm512_permute_pd(v, 0xFF)
+#define SWAP512(v)  _mm512_permute_pd(v, 0x55)
+SPECTRUM_KERNELS(avx2, "avx2,fma", __m256d, 2, _mm256_loadu_pd, _mm256_storeu_pd, _mm256_set1_pd, _mm256_setzero_pd,
+                 _mm256_mul_pd, _mm256_fmadd_pd, _mm256_fmaddsub_pd, _mm256_fmsubadd_pd, DUPRE256, DUPIM256, SWAP256)
+SPECTRUM_KERNELS(avx512, "avx512f", __m512d, 4, _mm512_loadu_pd, _mm512_storeu_pd, _mm512_set1_pd, _mm512_setzero_pd,
+                 _mm512_mul_pd, _mm512_fmadd_pd, _mm512_fmaddsub_pd, _mm512_fmsubadd_pd, DUPRE512, DUPIM512, SWAP512)
+#endif
+#pragma GCC diagnostic pop
+#endif
+
+/*==================================================================*/
+/* runtime dispatch */
+struct SpectrumKernels
+{
+  void (*mul)(const fft_complex *, const fft_complex *, double, fft_complex *, int);
+  void (*mul_conj)(const fft_complex *, const fft_complex *, double, fft_complex *, int);
+  void (*mul_sum)(const fft_complex * const *, const fft_complex * const *, const double *, int, fft_complex *, int);
+  void (*scale)(const fft_complex *, double, fft_complex *, int);
+  void (*axpy)(const fft_complex *, double, fft_complex *, int);
+};
+
+static const SpectrumKernels spectrum_kernels[] =
+{
+  {mul_scalar, mul_conj_scalar, mul_sum_scalar, scale_scalar, axpy_scalar},
+#ifdef SPECTRUM_X86
+  {mul_avx2, mul_conj_avx2, mul_sum_avx2, scale_avx2, axpy_avx2},
+  {mul_avx512, mul_conj_avx512, mul_sum_avx512, scale_avx512, axpy_avx512},
+#endif
+};
+
+/* the best instruction set supported by the CPU */
+static int spectrum_isa_detect()
+{
+  int isa = SPECTRUM_SCALAR;
+#ifdef SPECTRUM_X86
+  __builtin_cpu_init();
+  if(__builtin_cpu_supports("avx512f"))
+    isa = SPECTRUM_AVX512;
+  else if(__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma"))
+    isa = SPECTRUM_AVX2;
+#endif
+  return isa;
+}
+
+/* detected once, the initialization of the local static is thread-safe */
+static int spectrum_isa_max()
+{
+  static const int isa_max = spectrum_isa_detect();
+  return isa_max;
+}
+
+/* instruction set lowered by spectrum_set_isa, -1 for the best one */
+static atomic<int> spectrum_isa(-1);
+
+int spectrum_get_isa()
+{
+  int isa = spectrum_isa.load(memory_order_relaxed);
+  return (isa < 0)?spectrum_isa_max():isa;
+}
+
+void spectrum_set_isa(int isa)
+{
+  if(isa < SPECTRUM_SCALAR)
+    isa = SPECTRUM_SCALAR;
+  if(isa > spectrum_isa_max())
+    isa = spectrum_isa_max();
+  spectrum_isa.store(isa, memory_order_relaxed);
+}
+
+const char *spectrum_isa_name(int isa)
+{
+  static const char *names[] = {"scalar", "AVX2", "AVX-512"};
+  if(isa < SPECTRUM_SCALAR || isa > SPECTRUM_AVX512)
+    return "unknown";
+  return names[isa];
+}
+
+/*==================================================================*/
+void spectrum_mul(const fft_complex *a, const fft_complex *b, double scale, fft_complex *out, int n)
+{
+  spectrum_kernels[spectrum_get_isa()].mul(a, b, scale, out, n);
+}
+
+void spectrum_mul_conj(const fft_complex *a, const fft_complex *b, double scale, fft_complex *out, int n)
+{
+  spectrum_kernels[spectrum_get_isa()].mul_conj(a, b, scale, out, n);
+}
+
+void spectrum_mul_sum(const fft_complex * const *a, const fft_complex * const *b, const double *scale, int nk,
+                      fft_complex *out, int n)
+{
+  spectrum_kernels[spectrum_get_isa()].mul_sum(a, b, scale, nk, out, n);
+}
+
+void spectrum_scale(const fft_complex *a, double scale, fft_complex *out, int n)
+{
+  spectrum_kernels[spectrum_get_isa()].scale(a, scale, out, n);
+}
+
+void spectrum_axpy(const fft_complex *a, double scale, fft_complex *out, int n)
+{
+  spectrum_kernels[spectrum_get_isa()].axpy(a, scale, out, n);
+}
@@ -0,0 +1,38 @@
+/*
+ *  PIXON
+ *  A Pixon-based method for reconstructing velocity-delay map in reverberation mapping.
+ *
+ *  Yan-Rong Li, liyanrong@mail.ihep.ac.cn
+ *
+ */
+#ifndef _SPECTRUM_HPP
+
+#define _SPECTRUM_HPP
+
+#include "utilities.hpp"
+
+/*
+ * kernels on complex spectra stored as interleaved (re, im) pairs.
+ * vectorized versions for AVX2 and AVX-512 are selected at the first call
+ * according to the CPU, with a scalar fallback.
+ */
+enum SPECTRUM_ISA {SPECTRUM_SCALAR=0, SPECTRUM_AVX2=1, SPECTRUM_AVX512=2};
+
+/* out = a * b * scale */
+void spectrum_mul(const fft_complex *a, const fft_complex *b, double scale, fft_complex *out, int n);
+/* out = a * conj(b) * scale */
+void spectrum_mul_conj(const fft_complex *a, const fft_complex *b, double scale, fft_complex *out, int n);
+/* out = sum_k a[k] * b[k] * scale[k], over nk pairs of spectra */
+void spectrum_mul_sum(const fft_complex * const *a, const fft_complex * const *b, const double *scale, int nk,
+                      fft_complex *out, int n);
+/* out = a * scale */
+void spectrum_scale(const fft_complex *a, double scale, fft_complex *out, int n);
+/* out += a * scale */
+void spectrum_axpy(const fft_complex *a, double scale, fft_complex *out, int n);
+
+/* instruction set in use, it can be lowered, but not above what the CPU supports */
+int spectrum_get_isa();
+void spectrum_set_isa(int isa);
+const char *spectrum_isa_name(int isa);
+
+#endif
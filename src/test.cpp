@@ -4,11 +4,13 @@
 #include <cmath>
 #include <cstring>
 #include <random>
+#include <chrono>
 #include <nlopt.hpp>
 #include <fftw3.h>
 
 #include "proto.hpp"
 #include "utilities.hpp"
+#include "spectrum.hpp"
 #include "cont_model.hpp"
 #include "tnc.h"
 
@@ -25,7 +27,9 @@ void test_nlopt()
 
   int npixel = cont.size*0.3, npixon = 8;
   int i;
-  Pixon pixon(cont, line, npixel, npixon);
+  PixonContext ctx;
+  ctx.reserve(npixon);
+  Pixon pixon(ctx, cont, line, npixel, npixon);
   nlopt::opt opt0(nlopt::GN_ISRES, npixel);
   nlopt::opt opt1(nlopt::LN_BOBYQA, npixel);
   nlopt::opt opt2(nlopt::LD_SLSQP, npixel);
@@ -103,7 +107,7 @@ void test_nlopt()
   for(i=0; i<npixel; i++)
   {
     xr = exp(-0.5 * pow(pixon.dt*i-300.0, 2)/(50.0*50.0)) * 1.0/sqrt(2.0*M_PI)/50.0;
-    fout<<pixon.dt*i<<"  "<<exp(x_old[i])<<"  "<<image[i]<<"  "<<pixon_function(pixon.dt*i, 300.0, 50.0)<<"  "<<xr<<endl;
+    fout<<pixon.dt*i<<"  "<<exp(x_old[i])<<"  "<<image[i]<<"  "<<ctx.basis.function(pixon.dt*i, 300.0, 50.0)<<"  "<<xr<<endl;
   }
   fout.close();
 
@@ -159,7 +163,9 @@ void test()
     pseudo_img[i] = resp[i];
     pixon_map[i] = np-1;
   }
-  PixonFFT pfft(nr, np);
+  PixonContext ctx;
+  ctx.reserve(np);
+  PixonFFT pfft(ctx, nr, np);
   pfft.convolve(pseudo_img, pixon_map, conv_img);
 
   ofstream fout;
@@ -190,4 +196,186 @@ void test()
   delete[] pseudo_img;
   delete[] pixon_map;
   delete[] conv_img;
-}
\ No newline at end of file
+}
+
+/* 
+ * benchmark of FFT lengths, raw nd+npad versus lengths rounded by next_fft_size,
+ * the lengths are typical of RMFFT (cont_recon.size + max(npixel-ipositive, ipositive)) 
+ * and PixonFFT (npixel + npixon_size_max*pixon_size_factor).
+ */
+void test_fft_size()
+{
+  int lens[] = {1213, 1447, 1601, 2011, 2383, 3037, 4211, 513+10, 701+20, 997+10};
+  int nlen = sizeof(lens)/sizeof(int);
+  int i, j, k, n, nrep = 2000;
+  double *real;
+  fftw_complex *cmpl;
+  fftw_plan pf, pb;
+  double t[2];
+
+  cout<<setw(8)<<"raw"<<setw(12)<<"time(us)"<<setw(8)<<"padded"<<setw(12)<<"time(us)"<<setw(10)<<"speedup"<<endl;
+  for(i=0; i<nlen; i++)
+  {
+    for(k=0; k<2; k++)
+    {
+      n = (k==0)?lens[i]:next_fft_size(lens[i]);
+      real = (double *)fftw_malloc(n*sizeof(double));
+      cmpl = (fftw_complex *)fftw_malloc((n/2+1)*sizeof(fftw_complex));
+      pf = fftw_plan_dft_r2c_1d(n, real, cmpl, FFTW_MEASURE);
+      pb = fftw_plan_dft_c2r_1d(n, cmpl, real, FFTW_MEASURE);
+      for(j=0; j<n; j++)
+      {
+        real[j] = sin(0.1*j);
+      }
+
+      auto start = chrono::steady_clock::now();
+      for(j=0; j<nrep; j++)
+      {
+        fftw_execute(pf);
+        fftw_execute(pb);
+      }
+      auto end = chrono::steady_clock::now();
+      t[k] = chrono::duration<double, micro>(end - start).count()/nrep;
+
+      fftw_destroy_plan(pf);
+      fftw_destroy_plan(pb);
+      fftw_free(real);
+      fftw_free(cmpl);
+    }
+    cout<<setw(8)<<lens[i]<<setw(12)<<t[0]<<setw(8)<<next_fft_size(lens[i])<<setw(12)<<t[1]
+        <<setw(10)<<t[0]/t[1]<<endl;
+  }
+}
+
+/* time the spectrum kernels for each instruction set the CPU supports */
+void test_spectrum()
+{
+  int lens[] = {1024, 4096, 16384, 65536};
+  int nlen = sizeof(lens)/sizeof(int);
+  int i, j, k, op, isa, isa_max, n, nk = 4, nrep;
+  fft_complex *a[4], *b[4], *out;
+  double scale[4] = {0.3, -1.2, 2.0, 0.5}, t;
+  const char *names[] = {"mul", "mul_conj", "mul_sum", "axpy"};
+
+  isa_max = spectrum_get_isa();
+  cout<<setw(8)<<"n"<<setw(10)<<"kernel";
+  for(isa=0; isa<=isa_max; isa++)
+    cout<<setw(14)<<spectrum_isa_name(isa);
+  cout<<"  (time in us)"<<endl;
+
+  for(i=0; i<nlen; i++)
+  {
+    n = lens[i]/2+1;
+    nrep = 20000000/lens[i];
+    for(k=0; k<nk; k++)
+    {
+      a[k] = (fft_complex *)fft_malloc(n*sizeof(fft_complex));
+      b[k] = (fft_complex *)fft_malloc(n*sizeof(fft_complex));
+      for(j=0; j<n; j++)
+      {
+        a[k][j][0] = sin(0.1*j+k); a[k][j][1] = cos(0.2*j);
+        b[k][j][0] = cos(0.3*j);   b[k][j][1] = sin(0.4*j+k);
+      }
+    }
+    out = (fft_complex *)fft_malloc(n*sizeof(fft_complex));
+    memset(out, 0, n*sizeof(fft_complex));
+
+    for(op=0; op<4; op++)
+    {
+      cout<<setw(8)<<lens[i]<<setw(10)<<names[op];
+      for(isa=0; isa<=isa_max; isa++)
+      {
+        spectrum_set_isa(isa);
+        auto start = chrono::steady_clock::now();
+        for(j=0; j<nrep; j++)
+        {
+          switch(op)
+          {
+            case 0: spectrum_mul(a[0], b[0], 0.5, out, n); break;
+            case 1: spectrum_mul_conj(a[0], b[0], 0.5, out, n); break;
+            case 2: spectrum_mul_sum(a, b, scale, nk, out, n); break;
+            case 3: spectrum_axpy(a[0], 1.0e-3, out, n); break;
+          }
+        }
+        auto end = chrono::steady_clock::now();
+        t = chrono::duration<double, micro>(end - start).count()/nrep;
+        cout<<setw(14)<<t;
+      }
+      cout<<endl;
+    }
+
+    for(k=0; k<nk; k++)
+    {
+      fft_free(a[k]);
+      fft_free(b[k]);
+    }
+    fft_free(out);
+  }
+  spectrum_set_isa(isa_max);
+}
+
+/* counters of objective and hessian product calls in test_hessp */
+static int ncall_func, ncall_hessp;
+
+static int func_tnc_count(double x[], double *f, double g[], void *state)
+{
+  ncall_func++;
+  return func_tnc(x, f, g, state);
+}
+
+static int hessp_tnc_count(double x[], double v[], double hv[], void *state)
+{
+  ncall_hessp++;
+  return hessp_tnc(x, v, hv, state);
+}
+
+/* 
+ * TNC fits of a transfer function with the hessian products by finite differences 
+ * of the gradient and by the exact products, from the same starting point.
+ */
+void test_hessp()
+{
+  Data cont, line;
+  string fcon, fline;
+  fcon="data/con.txt";
+  cont.load(fcon);
+  fline = "data/line.txt";
+  line.load(fline);
+
+  int npixel = cont.size*0.3, npixon = 8, ipositive = 0;
+  int i, k, ndim = npixel+1;
+  int rc, maxCGit = ndim, maxnfeval = 10000, nfeval, niter;
+  double f, t, eta = -1.0, stepmx = -1.0, accuracy = 1.0e-6, fmin = line.size, 
+    ftol = 1.0e-6, xtol = 1.0e-6, pgtol = 1.0e-6, rescale = -1.0;
+  vector<double> x(ndim), g(ndim), low(ndim), up(ndim);
+  const char *names[] = {"finite diff", "exact"};
+  PixonContext ctx;
+  ctx.reserve(npixon);
+
+  cout<<setw(12)<<"hessp"<<setw(8)<<"niter"<<setw(8)<<"nfeval"<<setw(8)<<"nfunc"<<setw(8)<<"nhessp"
+      <<setw(16)<<"f"<<setw(12)<<"time(ms)"<<endl;
+  for(k=0; k<2; k++)
+  {
+    Pixon pixon(ctx, cont, line, npixel, npixon, ipositive);
+    for(i=0; i<npixel; i++)
+    {
+      low[i] = -100.0;
+      up[i] = 10.0;
+      x[i] = log(1.0/(npixel * pixon.dt));
+    }
+    low[npixel] = -1.0;
+    up[npixel] = 1.0;
+    x[npixel] = 0.0;
+
+    ncall_func = ncall_hessp = 0;
+    auto start = chrono::steady_clock::now();
+    rc = tnc(ndim, x.data(), &f, g.data(), func_tnc_count, (void *)&pixon, low.data(), up.data(), 
+        NULL, NULL, TNC_MSG_NONE, maxCGit, maxnfeval, eta, stepmx, accuracy, fmin, ftol, xtol, pgtol,
+        rescale, &nfeval, &niter, NULL, k==0?NULL:hessp_tnc_count);
+    auto end = chrono::steady_clock::now();
+    t = chrono::duration<double, milli>(end - start).count();
+
+    cout<<setw(12)<<names[k]<<setw(8)<<niter<<setw(8)<<nfeval<<setw(8)<<ncall_func<<setw(8)<<ncall_hessp
+        <<setw(16)<<f<<setw(12)<<t<<"  "<<tnc_rc_string[rc - TNC_MINRC]<<endl;
+  }
+}
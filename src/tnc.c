@@ -109,7 +109,7 @@ static tnc_rc tnc_minimize(int n, double x[], double *f, double g[],
                            double eta, double stepmx, double accuracy,
                            double fmin, double ftol, double xtol,
                            double pgtol, double rescale,
-                           tnc_callback * callback);
+                           tnc_callback * callback, tnc_hessp * hessp);
 
 static getptc_rc getptcInit(double *reltol, double *abstol, double tnytol,
                             double eta, double rmu, double xbnd,
@@ -152,6 +152,7 @@ static int tnc_direction(double *zsol, double *diagb,
                          logical upd1, double yksk, double yrsr,
                          double *sk, double *yk, double *sr, double *yr,
                          logical lreset, tnc_function * function,
+                         tnc_hessp * hessp,
                          void *state, double xscale[], double xoffset[],
                          double fscale, int *pivot, double accuracy,
                          double gnorm, double xnorm, double *low,
@@ -178,7 +179,8 @@ static void project(int n, double x[], const int pivot[]);
 
 static int hessianTimesVector(double v[], double gv[], int n,
                               double x[], double g[],
-                              tnc_function * function, void *state,
+                              tnc_function * function, tnc_hessp * hessp,
+                              void *state,
                               double xscale[], double xoffset[],
                               double fscale, double accuracy, double xnorm,
                               double low[], double up[]);
@@ -241,7 +243,8 @@ int tnc(int n, double x[], double *f, double g[], tnc_function * function,
         double offset[], int messages, int maxCGit, int maxnfeval,
         double eta, double stepmx, double accuracy, double fmin,
         double ftol, double xtol, double pgtol, double rescale,
-        int *nfeval, int *niter, tnc_callback * callback)
+        int *nfeval, int *niter, tnc_callback * callback,
+        tnc_hessp * hessp)
 {
     int rc, frc, i, nc, nfeval_local, free_low = TNC_FALSE,
         free_up = TNC_FALSE, free_g = TNC_FALSE;
@@ -408,7 +411,7 @@ int tnc(int n, double x[], double *f, double g[], tnc_function * function,
                       xscale, xoffset, &fscale, low, up, messages,
                       maxCGit, maxnfeval, nfeval, niter, eta, stepmx,
                       accuracy, fmin, ftol, xtol, pgtol, rescale,
-                      callback);
+                      callback, hessp);
 
   cleanup:
     if (messages & TNC_MSG_EXIT) {
@@ -520,7 +523,7 @@ static tnc_rc tnc_minimize(int n, double x[],
                            double eta, double stepmx, double accuracy,
                            double fmin, double ftol, double xtol,
                            double pgtol, double rescale,
-                           tnc_callback * callback)
+                           tnc_callback * callback, tnc_hessp * hessp)
 {
     double fLastReset, difnew, epsred, oldgtp, difold, oldf, xnorm, newscale,
         gnorm, ustpmax, fLastConstraint, spe, yrsr, yksk,
@@ -686,7 +689,7 @@ static tnc_rc tnc_minimize(int n, double x[],
         /* Compute the new search direction */
         frc = tnc_direction(pk, diagb, x, g, n, maxCGit, maxnfeval, nfeval,
                             upd1, yksk, yrsr, sk, yk, sr, yr,
-                            lreset, function, state, xscale, xoffset,
+                            lreset, function, hessp, state, xscale, xoffset,
                             *fscale, pivot, accuracy, gnorm, xnorm, low,
                             up);
 
@@ -1087,6 +1090,7 @@ static int tnc_direction(double *zsol, double *diagb,
                          logical upd1, double yksk, double yrsr,
                          double *sk, double *yk, double *sr, double *yr,
                          logical lreset, tnc_function * function,
+                         tnc_hessp * hessp,
                          void *state, double xscale[], double xoffset[],
                          double fscale, int *pivot, double accuracy,
                          double gnorm, double xnorm, double low[],
@@ -1181,7 +1185,7 @@ static int tnc_direction(double *zsol, double *diagb,
         }
 
         project(n, v, pivot);
-        frc = hessianTimesVector(v, gv, n, x, g, function, state,
+        frc = hessianTimesVector(v, gv, n, x, g, function, hessp, state,
                                  xscale, xoffset, fscale, accuracy, xnorm,
                                  low, up);
         ++(*nfeval);
@@ -1292,12 +1296,13 @@ static double initialStep(double fnew, double fmin, double gtp,
  */
 static int hessianTimesVector(double v[], double gv[], int n,
                               double x[], double g[],
-                              tnc_function * function, void *state,
+                              tnc_function * function, tnc_hessp * hessp,
+                              void *state,
                               double xscale[], double xoffset[],
                               double fscale, double accuracy, double xnorm,
                               double low[], double up[])
 {
-    double dinv, f, delta, *xv;
+    double dinv, f, delta, *xv, *vv;
     int i, frc;
 
     xv = malloc(sizeof(*xv) * n);
@@ -1305,6 +1310,31 @@ static int hessianTimesVector(double v[], double gv[], int n,
         return -1;
     }
 
+    if (hessp != NULL) {
+        /* Exact product in the unscaled variables, the scaled hessian is
+           fscale * diag(xscale) * H * diag(xscale) */
+        vv = malloc(sizeof(*vv) * n);
+        if (vv == NULL) {
+            free(xv);
+            return -1;
+        }
+        dcopy1(n, x, xv);
+        unscalex(n, xv, xscale, xoffset);
+        coercex(n, xv, low, up);
+        for (i = 0; i < n; i++) {
+            vv[i] = v[i] * xscale[i];
+        }
+        frc = hessp(xv, vv, gv, state);
+        free(xv);
+        free(vv);
+        if (frc) {
+            return 1;
+        }
+        scaleg(n, gv, xscale, fscale);
+        projectConstants(n, gv, xscale);
+        return 0;
+    }
+
     delta = accuracy * (xnorm + 1.0);
     for (i = 0; i < n; i++) {
         xv[i] = x[i] + delta * v[i];
@@ -109,6 +109,20 @@ typedef int tnc_function(double x[], double *f, double g[], void *state);
  */
 typedef void tnc_callback(double x[], void *state);
 
+/*
+ * An optional function returning the product of the hessian of the function
+ * at x with a vector v, as required by tnc
+ *
+ * x     : on input, the vector of variables (should not be modified)
+ * v     : on input, the vector to multiply (should not be modified)
+ * hv    : on output, the hessian at x times v
+ * state : on input, the value of the state variable as provided to tnc
+ *
+ * must returns 0 if no error occurs or 1 to immediately end the minimization.
+ *
+ */
+typedef int tnc_hessp(double x[], double v[], double hv[], void *state);
+
 /*
  * tnc : minimize a function with variables subject to bounds, using
  *       gradient information.
@@ -158,6 +172,12 @@ typedef void tnc_callback(double x[], void *state);
  *             if < 0, rescale is set to 1.3
  * nfeval    : on output, the number of function evaluations.
  *             ignored if nfeval==NULL.
+ *             each hessian times vector product counts as one evaluation.
+ * niter     : on output, the number of iterations.
+ * callback  : called after each iteration (see tnc_callback), or NULL
+ * hessp     : hessian times vector function (see tnc_hessp), or NULL,
+ *             in which case the products are approximated by finite
+ *             differences of the gradient.
  *
  * The tnc function returns a code defined in the tnc_rc enum.
  * On output, x, f and g may be very slightly out of sync because of scaling.
@@ -168,7 +188,8 @@ extern int tnc(int n, double x[], double *f, double g[],
   double low[], double up[], double scale[], double offset[],
   int messages, int maxCGit, int maxnfeval, double eta, double stepmx,
   double accuracy, double fmin, double ftol, double xtol, double pgtol,
-  double rescale, int *nfeval, int *niter, tnc_callback *callback);
+  double rescale, int *nfeval, int *niter, tnc_callback *callback,
+  tnc_hessp *hessp);
 
 #ifdef __cplusplus
 }
@@ -11,15 +11,294 @@
 #include <iomanip>
 #include <cstring>
 #include <cmath>
+#include <map>
+#include <sstream>
+#include <tuple>
+#include <mutex>
+#include <chrono>
 
 #include "utilities.hpp"
+#include "spectrum.hpp"
 
-int pixon_size_factor;
-int pixon_sub_factor;
-int pixon_map_low_bound;
+unsigned int fft_planner_flag = FFTW_PATIENT;
+bool conv_cost_timed = false;
+int fft_nthreads = 1;
+int fft_thread_min = 16384;
+int grad_nthreads = 1;
 
 using namespace std;
 
+/* 
+ * set the FFTW planner flag from its name, 
+ * estimate, measure, patient, or exhaustive 
+ */
+void set_fft_planner(string planner)
+{
+  if(planner == "estimate")
+  {
+    fft_planner_flag = FFTW_ESTIMATE;
+  }
+  else if(planner == "measure")
+  {
+    fft_planner_flag = FFTW_MEASURE;
+  }
+  else if(planner == "patient")
+  {
+    fft_planner_flag = FFTW_PATIENT;
+  }
+  else if(planner == "exhaustive")
+  {
+    fft_planner_flag = FFTW_EXHAUSTIVE;
+  }
+  else 
+  {
+    cout<<"Incorrect fft_planner: "<<planner<<endl;
+    cout<<"exit!"<<endl;
+    exit(0);
+  }
+}
+
+/* 
+ * set the cost model of the direct versus FFT convolution from its name, 
+ * model: operation counts, the same choices in every run; 
+ * timed: timings on this machine, measured once per transform length
+ */
+void set_conv_cost(string cost)
+{
+  if(cost == "model")
+  {
+    conv_cost_timed = false;
+  }
+  else if(cost == "timed")
+  {
+    conv_cost_timed = true;
+  }
+  else 
+  {
+    cout<<"Incorrect conv_cost: "<<cost<<endl;
+    cout<<"exit!"<<endl;
+    exit(0);
+  }
+}
+
+
+/* 
+ * set the number of FFTW threads, only transforms with at least nmin points 
+ * (length times number of transforms) are planned with threads.
+ * must be called before any other FFTW function.
+ */
+void set_fft_threads(int nthreads, int nmin)
+{
+  fft_thread_min = nmin;
+#ifdef PIXON_FFT_THREADS
+  static bool fft_threads_init = false;
+  if(nthreads > 1 && !fft_threads_init)
+  {
+    if(!fft_init_threads())
+    {
+      cout<<"Cannot initialize FFTW threads."<<endl;
+      cout<<"exit!"<<endl;
+      exit(0);
+    }
+    fft_threads_init = true;
+  }
+  fft_nthreads = nthreads;
+#else
+  if(nthreads > 1)
+  {
+    cout<<"FFTW threads not enabled in this build, fft_threads ignored."<<endl;
+  }
+  fft_nthreads = 1;
+#endif
+}
+
+/* 
+ * stream of the progress messages of the calling thread, stdout unless redirected 
+ * to a buffer, so that reconstructions running concurrently do not interleave their messages.
+ */
+static thread_local ostringstream *pixon_log_buffer = NULL;
+static mutex pixon_log_mutex;
+
+ostream& pixon_log()
+{
+  if(pixon_log_buffer != NULL)
+    return *pixon_log_buffer;
+  return cout;
+}
+
+/* redirect the messages of the calling thread to buf, NULL to stdout */
+void set_pixon_log(ostringstream *buf)
+{
+  pixon_log_buffer = buf;
+}
+
+/* print the buffered messages of the calling thread at once, and empty the buffer */
+void flush_pixon_log()
+{
+  if(pixon_log_buffer == NULL)
+    return;
+
+  lock_guard<mutex> lock(pixon_log_mutex);
+  cout<<pixon_log_buffer->str()<<flush;
+  pixon_log_buffer->str("");
+}
+
+/* 
+ * stop on an error in a reconstruction, also from a worker thread: the buffered messages 
+ * are printed first, the error goes to stderr, and the exit status is non-zero.
+ */
+void pixon_fatal(string msg)
+{
+  flush_pixon_log();
+  {
+    lock_guard<mutex> lock(pixon_log_mutex);
+    cerr<<msg<<endl;
+    cerr<<"exit!"<<endl;
+  }
+  exit(1);
+}
+
+/* set the number of threads of the per-pixel gradient loops, before the Pixon objects are created */
+void set_grad_threads(int nthreads)
+{
+#ifdef _OPENMP
+  grad_nthreads = nthreads;
+#else
+  if(nthreads > 1)
+  {
+    cout<<"OpenMP not enabled in this build, grad_threads ignored."<<endl;
+  }
+  grad_nthreads = 1;
+#endif
+}
+
+/* import FFTW wisdom, so that plans of the same sizes need not be measured again */
+void import_fft_wisdom(string fname)
+{
+  if(fname.empty())
+    return;
+
+  if(fft_import_wisdom_from_filename(fname.c_str()))
+  {
+    cout<<"FFTW wisdom imported from "<<fname<<"."<<endl;
+  }
+  else 
+  {
+    cout<<"No FFTW wisdom imported from "<<fname<<"."<<endl;
+  }
+}
+
+/* export FFTW wisdom accumulated in this run */
+void export_fft_wisdom(string fname)
+{
+  if(fname.empty())
+    return;
+  
+  if(!fft_export_wisdom_to_filename(fname.c_str()))
+  {
+    cout<<"Cannot export FFTW wisdom to "<<fname<<"."<<endl;
+  }
+}
+
+/*==================================================================*/
+/* 
+ * registry of FFT plans shared by all FFT objects, keyed by 
+ * (length, direction, number of transforms, alignment, number of threads).
+ * plans are executed with the new-array interface, so objects of the same 
+ * length share the same plans and only need their own buffers.
+ */
+typedef tuple<int, int, int, int, int> fft_plan_key;
+static map<fft_plan_key, fft_plan> fft_plan_registry;
+static mutex fft_plan_mutex;
+
+/* 
+ * get the plan of howmany contiguous transforms of length n, 
+ * kind is FFT_R2C or FFT_C2R, alignment is fftw_alignment_of() of the arrays.
+ * batched plans (howmany > 1) are created on demand inside the optimization, 
+ * so they are planned with FFTW_MEASURE at most.
+ */
+fft_plan get_fft_plan(int n, int kind, int howmany, int alignment)
+{
+  lock_guard<mutex> lock(fft_plan_mutex);
+  /* small transforms do not pay off the thread synchronization */
+  int nthreads = (n * howmany >= fft_thread_min) ? fft_nthreads : 1;
+  fft_plan_key key = make_tuple(n, kind, howmany, alignment, nthreads);
+  map<fft_plan_key, fft_plan>::iterator it = fft_plan_registry.find(key);
+  if(it != fft_plan_registry.end())
+    return it->second;
+
+  /* scratch arrays with the same alignment, planning overwrites them */
+  int n_cal = n/2 + 1;
+  char *buf_real = (char *) fft_malloc(howmany * n * sizeof(fft_real) + alignment);
+  char *buf_cmpl = (char *) fft_malloc(howmany * n_cal * sizeof(fft_complex) + alignment);
+  fft_real *real = (fft_real *)(buf_real + alignment);
+  fft_complex *cmpl = (fft_complex *)(buf_cmpl + alignment);
+  fft_plan plan;
+  unsigned int flag = fft_planner_flag;
+
+  if(howmany > 1 && (flag & (FFTW_PATIENT | FFTW_EXHAUSTIVE)))
+    flag = FFTW_MEASURE;
+
+#ifdef PIXON_FFT_THREADS
+  if(fft_nthreads > 1)
+    fft_plan_with_nthreads(nthreads);
+#endif
+  if(kind == FFT_R2C)
+  {
+    plan = fft_plan_many_dft_r2c(1, &n, howmany, real, NULL, 1, n, cmpl, NULL, 1, n_cal, flag);
+  }
+  else 
+  {
+    plan = fft_plan_many_dft_c2r(1, &n, howmany, cmpl, NULL, 1, n_cal, real, NULL, 1, n, flag);
+  }
+
+  fft_free(buf_real);
+  fft_free(buf_cmpl);
+
+  if(plan == NULL)
+  {
+    pixon_fatal("Cannot create FFT plan of length " + to_string(n) + ".");
+  }
+  fft_plan_registry[key] = plan;
+  return plan;
+}
+
+/* 
+ * report the objective difference of the FFT path against the reference evaluation 
+ * with direct convolutions in double, only in single-precision builds.
+ * only pixon is switched to the reference, the state is evaluated at x again afterwards.
+ */
+void report_fft_precision(Pixon& pixon, tnc_function *func, double *x, int n, void *state)
+{
+#ifdef PIXON_FFT_FLOAT
+  double f, f_ref;
+  double *g = new double[n];
+
+  pixon.set_reference(true);
+  func(x, &f_ref, g, state);
+  pixon.set_reference(false);
+  func(x, &f, g, state);
+
+  pixon_log()<<"single-precision FFT objective: "<<f<<", double reference: "<<f_ref
+      <<", relative difference: "<<fabs(f - f_ref)/fabs(f_ref)<<endl;
+  delete[] g;
+#else
+  (void)pixon; (void)func; (void)x; (void)n; (void)state;
+#endif
+}
+
+/* destroy all plans in the registry, no FFT object should be alive */
+void destroy_fft_plans()
+{
+  lock_guard<mutex> lock(fft_plan_mutex);
+  map<fft_plan_key, fft_plan>::iterator it;
+  for(it = fft_plan_registry.begin(); it != fft_plan_registry.end(); ++it)
+  {
+    fft_destroy_plan(it->second);
+  }
+  fft_plan_registry.clear();
+}
+
 /*==================================================================*/
 /* class configuration */
 Config::Config()
@@ -37,6 +316,18 @@ Config::Config()
   pixon_size_factor = 1;
   pixon_sub_factor = 1;
   pixon_map_low_bound = pixon_sub_factor - 1;
+
+  adjoint_grad = true;
+  exact_hessp = true;
+
+  fft_planner = "patient";
+  fftw_wisdom = "data/fftw_wisdom";
+  pixon_conv = "auto";
+  conv_cost = "model";
+  fft_threads = 1;
+  fft_thread_min = 16384;
+  grad_threads = 1;
+  run_threads = 1;
 }
 Config::~Config()
 {
@@ -124,6 +415,87 @@ void Config::load_cfg(string fname)
   }
   pixon_map_low_bound = pixon_sub_factor - 1;
 
+  if(!configparser::extract(param.sections["param"]["adjoint_grad"], adjoint_grad))
+  {
+    adjoint_grad = true;
+  }
+  if(!configparser::extract(param.sections["param"]["exact_hessp"], exact_hessp))
+  {
+    exact_hessp = true;
+  }
+
+  if(!configparser::extract(param.sections["param"]["fft_planner"], fft_planner))
+  {
+    fft_planner = "patient";
+  }
+  if(fft_planner != "estimate" && fft_planner != "measure" 
+     && fft_planner != "patient" && fft_planner != "exhaustive")
+  {
+    cout<<"Incorrect configuration fft_planner: "<<fft_planner<<endl;
+    cout<<"exit!"<<endl;
+    exit(0);
+  }
+  /* an empty file name disables the wisdom */
+  configparser::extract(param.sections["param"]["fftw_wisdom"], fftw_wisdom);
+
+  if(!configparser::extract(param.sections["param"]["pixon_conv"], pixon_conv))
+  {
+    pixon_conv = "auto";
+  }
+  if(pixon_conv != "auto" && pixon_conv != "fft" && pixon_conv != "direct")
+  {
+    cout<<"Incorrect configuration pixon_conv: "<<pixon_conv<<endl;
+    cout<<"exit!"<<endl;
+    exit(0);
+  }
+  if(!configparser::extract(param.sections["param"]["conv_cost"], conv_cost))
+  {
+    conv_cost = "model";
+  }
+  if(conv_cost != "model" && conv_cost != "timed")
+  {
+    cout<<"Incorrect configuration conv_cost: "<<conv_cost<<endl;
+    cout<<"exit!"<<endl;
+    exit(0);
+  }
+
+  if(!configparser::extract(param.sections["param"]["fft_threads"], fft_threads))
+  {
+    fft_threads = 1;
+  }
+  if(!configparser::extract(param.sections["param"]["fft_thread_min"], fft_thread_min))
+  {
+    fft_thread_min = 16384;
+  }
+  if(fft_threads < 1)
+  {
+    cout<<"Incorrect configuration fft_threads: "<<fft_threads<<endl;
+    cout<<"exit!"<<endl;
+    exit(0);
+  }
+
+  if(!configparser::extract(param.sections["param"]["grad_threads"], grad_threads))
+  {
+    grad_threads = 1;
+  }
+  if(grad_threads < 1)
+  {
+    cout<<"Incorrect configuration grad_threads: "<<grad_threads<<endl;
+    cout<<"exit!"<<endl;
+    exit(0);
+  }
+
+  if(!configparser::extract(param.sections["param"]["run_threads"], run_threads))
+  {
+    run_threads = 1;
+  }
+  if(run_threads < 1)
+  {
+    cout<<"Incorrect configuration run_threads: "<<run_threads<<endl;
+    cout<<"exit!"<<endl;
+    exit(0);
+  }
+
   if(drv_lc_model < 0 || drv_lc_model > 3)
   {
     cout<<"Incorrect configuration drv_lc_model."<<endl;
@@ -151,108 +523,226 @@ void Config::print_cfg()
   fout<<setw(24)<<left<<"pixon_map_low_bound"<<" = "<<pixon_map_low_bound<<endl;
   fout<<setw(24)<<left<<"max_pixon_size"<<" = "<<max_pixon_size<<endl;
   fout<<setw(24)<<left<<"sensitivity"<<" = "<<sensitivity<<endl;
+  fout<<setw(24)<<left<<boolalpha<<"adjoint_grad"<<" = "<<adjoint_grad<<endl;
+  fout<<setw(24)<<left<<boolalpha<<"exact_hessp"<<" = "<<exact_hessp<<endl;
+  fout<<setw(24)<<left<<"fft_planner"<<" = "<<fft_planner<<endl;
+  fout<<setw(24)<<left<<"fftw_wisdom"<<" = "<<fftw_wisdom<<endl;
+  fout<<setw(24)<<left<<"pixon_conv"<<" = "<<pixon_conv<<endl;
+  fout<<setw(24)<<left<<"conv_cost"<<" = "<<conv_cost<<endl;
+  fout<<setw(24)<<left<<"fft_threads"<<" = "<<fft_threads<<endl;
+  fout<<setw(24)<<left<<"fft_thread_min"<<" = "<<fft_thread_min<<endl;
+  fout<<setw(24)<<left<<"grad_threads"<<" = "<<grad_threads<<endl;
+  fout<<setw(24)<<left<<"run_threads"<<" = "<<run_threads<<endl;
   fout.close();
 }
 
 /*==================================================================*/
 /* class PixonBasis */
 
-double PixonBasis::norm_gaussian= sqrt(2*M_PI) * erf(3.0/sqrt(2.0));
-double PixonBasis::coeff1_modified_gaussian = exp(-0.5*9.0);
-double PixonBasis::coeff2_modified_gaussian =(1.0 - exp(-0.5*9.0));
-double PixonBasis::norm_modified_gaussian= (sqrt(2*M_PI) * erf(3.0/sqrt(2.0)) - 2*3.0*exp(-0.5*9.0))/PixonBasis::coeff2_modified_gaussian;
-
 string PixonBasis::pixonbasis_name[] = {"parabloid", "Gaussian", "modified Gaussian", "Lorentz", "Wendland", "triangle","top-hat"};
 
-/* modified gaussian function, truncated at factor * psize */
-double PixonBasis::gaussian(double x, double y, double psize)
+/* pixon function of a policy */
+template<class Kernel> 
+static double pixon_function_kernel(double x, double y, double psize, const PixonBasis &b)
 {
-  if(fabs(y-x) <= pixon_size_factor * psize)
-    return gaussian_norm(psize) * exp( -0.5*(y-x)*(y-x)/(psize/3*psize/3) );
-  else 
-    return 0.0;
+  return Kernel::value(y-x, psize, b);
 }
-double PixonBasis::gaussian_norm(double psize)
+
+template<class Kernel> 
+static double pixon_norm_kernel(double psize, const PixonBasis &b)
 {
-  return 1.0/(norm_gaussian*psize/3.0);
+  return Kernel::norm(psize, b);
 }
 
-/* modified gaussian function, truncated at factor * psize */
-double PixonBasis::modified_gaussian(double x, double y, double psize)
+/* one loop over the kernel of a basis, inlined for each policy. the constants are 
+ * copied, so that they are not reloaded after each store to k.
+ */
+template<class Kernel> 
+static void pixon_fill_kernel(double *k, int n, double x0, double psize, const PixonBasis &b)
 {
-  if(fabs(y-x) <= pixon_size_factor * psize)
-    return gaussian_norm(psize)/coeff2_modified_gaussian * (exp( -0.5*(y-x)*(y-x)/(psize/3*psize/3) ) - coeff1_modified_gaussian);
-  else 
-    return 0.0;
+  int j;
+  const PixonBasis bc = b;
+  for(j=0; j<n; j++)
+  {
+    k[j] = Kernel::value(x0 + j, psize, bc);
+  }
 }
-double PixonBasis::modified_gaussian_norm(double psize)
+
+/* basis functions of each type, in the order of pixonbasis_name */
+struct PixonBasisKernels
+{
+  double (*function)(double x, double y, double psize, const PixonBasis &b);
+  double (*norm)(double psize, const PixonBasis &b);
+  void (*fill)(double *k, int n, double x0, double psize, const PixonBasis &b);
+};
+
+static const PixonBasisKernels pixon_basis_kernels[] = 
 {
-  return 1.0/(norm_modified_gaussian*psize/3.0);
+  {pixon_function_kernel<PixonKernelParabloid>, pixon_norm_kernel<PixonKernelParabloid>, pixon_fill_kernel<PixonKernelParabloid>},
+  {pixon_function_kernel<PixonKernelGaussian>, pixon_norm_kernel<PixonKernelGaussian>, pixon_fill_kernel<PixonKernelGaussian>},
+  {pixon_function_kernel<PixonKernelModifiedGaussian>, pixon_norm_kernel<PixonKernelModifiedGaussian>, pixon_fill_kernel<PixonKernelModifiedGaussian>},
+  {pixon_function_kernel<PixonKernelLorentz>, pixon_norm_kernel<PixonKernelLorentz>, pixon_fill_kernel<PixonKernelLorentz>},
+  {pixon_function_kernel<PixonKernelWendland>, pixon_norm_kernel<PixonKernelWendland>, pixon_fill_kernel<PixonKernelWendland>},
+  {pixon_function_kernel<PixonKernelTriangle>, pixon_norm_kernel<PixonKernelTriangle>, pixon_fill_kernel<PixonKernelTriangle>},
+  {pixon_function_kernel<PixonKernelTophat>, pixon_norm_kernel<PixonKernelTophat>, pixon_fill_kernel<PixonKernelTophat>},
+};
+
+/* Gaussian with pixon size factor 1 */
+PixonBasis::PixonBasis()
+{
+  type = 1;
+  size_factor = 1;
+  norm_gaussian = sqrt(2*M_PI) * erf(3.0/sqrt(2.0));
+  coeff1_modified_gaussian = exp(-0.5*9.0);
+  coeff2_modified_gaussian = (1.0 - exp(-0.5*9.0));
+  norm_modified_gaussian = (sqrt(2*M_PI) * erf(3.0/sqrt(2.0)) - 2*3.0*exp(-0.5*9.0))/coeff2_modified_gaussian;
 }
 
-/* prarabloid function, truncated at factor * psize */
-double PixonBasis::parabloid(double x, double y, double psize)
+/* unknown types fall back to Gaussian */
+void PixonBasis::set(int type_in, int size_factor_in)
 {
-  double d = fabs(y-x)/(pixon_size_factor * psize);
-  if( d <= 1.0)
-    return parabloid_norm(psize) * (1.0 - d*d);
-  else 
-    return 0.0;
+  type = (type_in < 0 || type_in > 6)?1:type_in;
+  size_factor = size_factor_in;
+
+  switch(type)
+  {
+    case 1:  /* Gaussian */
+      norm_gaussian = sqrt(2.0*M_PI) * erf(3.0*size_factor/sqrt(2.0));
+      break;
+    
+    case 2: /* modified Gaussian */
+      coeff1_modified_gaussian = exp(-0.5 * size_factor*3.0*size_factor*3.0);
+      coeff2_modified_gaussian = 1.0 - coeff1_modified_gaussian;
+      norm_gaussian = (sqrt(2.0*M_PI) * erf(3.0*size_factor/sqrt(2.0)) 
+                    - 2.0*3.0*size_factor * coeff1_modified_gaussian)/coeff2_modified_gaussian;
+      break;
+  }
 }
-double PixonBasis::parabloid_norm(double psize)
+
+double PixonBasis::function(double x, double y, double psize) const
 {
-  return 1.0/(psize * 4.0/3.0 * pixon_size_factor);
+  return pixon_basis_kernels[type].function(x, y, psize, *this);
 }
 
-double PixonBasis::tophat(double x, double y, double psize)
+double PixonBasis::norm(double psize) const
 {
-  if(fabs(y-x) <= pixon_size_factor * psize)
-    return parabloid_norm(psize);
-  else 
-    return 0.0;
+  return pixon_basis_kernels[type].norm(psize, *this);
 }
-double PixonBasis::tophat_norm(double psize)
+
+void PixonBasis::fill(double *k, int n, double x0, double psize) const
 {
-  return 1.0/(psize * 2.0*pixon_size_factor);
+  pixon_basis_kernels[type].fill(k, n, x0, psize, *this);
 }
 
-double PixonBasis::triangle(double x, double y, double psize)
+/*==================================================================*/
+/* class PixonKernelTable */
+PixonKernelTable::PixonKernelTable()
 {
-  double d = fabs(y-x)/(pixon_size_factor * psize);
-  if(d <= 1.0)
-    return triangle_norm(psize) * (1.0 - d);
-  else 
-    return 0.0;
+  nsize = 0;
+  hw = offset = NULL;
+  kernel = norm = NULL;
 }
-double PixonBasis::triangle_norm(double psize)
+
+PixonKernelTable::~PixonKernelTable()
 {
-  return 1.0/(pixon_size_factor * psize);
+  if(nsize > 0)
+  {
+    delete[] hw;
+    delete[] offset;
+    delete[] kernel;
+    delete[] norm;
+  }
 }
-double PixonBasis::lorentz(double x, double y, double psize)
+
+void PixonKernelTable::build(int nsize_in, int sub_factor, const PixonBasis &basis)
 {
-  double d = fabs(y-x)/(psize);
-  if(d <= pixon_size_factor)
-    return lorentz_norm(psize) / (1.0 + d*d*3*3);
-  else 
-    return 0.0;
+  int ip, n;
+  double psize;
+
+  if(nsize > 0)
+  {
+    delete[] hw;
+    delete[] offset;
+    delete[] kernel;
+    delete[] norm;
+  }
+  nsize = nsize_in;
+  hw = new int[nsize];
+  offset = new int[nsize];
+  norm = new double[nsize];
+  n = 0;
+  for(ip=0; ip<nsize; ip++)
+  {
+    psize = (ip+1)*1.0/sub_factor;
+    hw[ip] = (int)(basis.size_factor * psize);
+    offset[ip] = n;
+    n += hw[ip]+1;
+  }
+  kernel = new double[n];
+  for(ip=0; ip<nsize; ip++)
+  {
+    psize = (ip+1)*1.0/sub_factor;
+    basis.fill(kernel + offset[ip], hw[ip]+1, 0.0, psize);
+    norm[ip] = basis.norm(psize);
+  }
+}
+
+/*==================================================================*/
+/* class PixonContext */
+
+/* Gaussian, with pixon size factor and sub-resolution 1 */
+PixonContext::PixonContext()
+{
+  conv_mode = PIXON_CONV_AUTO;
+  pixon_size_factor = 1;
+  pixon_sub_factor = 1;
+  pixon_map_low_bound = 0;
 }
-double PixonBasis::lorentz_norm(double psize)
+
+void PixonContext::setup(int basis_type, int size_factor, int sub_factor, int map_low_bound)
 {
-  return 1.0/(2.0*psize/3.0 * atan(pixon_size_factor*3.0));
+  pixon_size_factor = size_factor;
+  pixon_sub_factor = sub_factor;
+  pixon_map_low_bound = map_low_bound;
+  basis.set(basis_type, pixon_size_factor);
+  if(basis.type == 6)  /* top-hat */
+  {
+    pixon_sub_factor = 1; /* enforce to 1 */
+  }
+
+  /* tabulate the sizes in use again with the new basis */
+  if(pixon_table.nsize > 0)
+    pixon_table.build(pixon_table.nsize, pixon_sub_factor, basis);
 }
 
-double PixonBasis::wendland(double x, double y, double psize)
+void PixonContext::reserve(int nsize)
 {
-  double d = fabs(y-x)/psize;
-  if( d <= 1.0 )
-    return wendland_norm(psize) * pow((1.0 - d), 4.0) * (4.0*d + 1);
-  else 
-    return 0.0;
+  if(nsize > pixon_table.nsize)
+    pixon_table.build(nsize, pixon_sub_factor, basis);
 }
-double PixonBasis::wendland_norm(double psize)
+
+void PixonContext::set_conv(string mode)
 {
-  return 1.5/psize;
+  if(mode == "auto")
+  {
+    conv_mode = PIXON_CONV_AUTO;
+  }
+  else if(mode == "fft")
+  {
+    conv_mode = PIXON_CONV_FFT;
+  }
+  else if(mode == "direct")
+  {
+    conv_mode = PIXON_CONV_DIRECT;
+  }
+  else 
+  {
+    cout<<"Incorrect pixon_conv: "<<mode<<endl;
+    cout<<"exit!"<<endl;
+    exit(0);
+  }
 }
+
 /*==================================================================*/
 /* class Data */
 Data::Data()
@@ -443,64 +933,194 @@ void Data::normalize()
 }
 
 /*==================================================================*/
-/* class DataFFT */
-DataFFT::DataFFT()
+/* 
+ * kernel taps of all pixon sizes on [-hw, hw], hw = pixon_size_factor*psize, from the 
+ * kernel table, all basis functions vanish beyond it. the taps are not normalized and 
+ * stored with a common width 2*hw_max+1, centered at hw_max.
+ * the table must have been reserved for npixon_size sizes.
+ */
+static void set_pixon_taps(const PixonContext &ctx, int npixon_size, int hw_max, double *taps, int *hw, double *norm)
 {
-  nd = npad = nd_fft = nd_fft_cal = 0;
-  data_fft = resp_fft = conv_fft = NULL;
-  data_real = resp_real = conv_real = NULL;
+  int ip, m, ntap;
+  double *t;
+  const PixonKernelTable &pixon_table = ctx.pixon_table;
+
+  if(npixon_size > pixon_table.nsize)
+  {
+    pixon_fatal("pixon kernels of " + to_string(npixon_size) + " sizes are not tabulated, only " 
+                + to_string(pixon_table.nsize) + ".");
+  }
+  ntap = 2*hw_max + 1;
+  for(ip=0; ip<npixon_size; ip++)
+  {
+    hw[ip] = pixon_table.hw[ip];
+    t = taps + ip*ntap + hw_max;
+    norm[ip] = 0.0;
+    for(m=-hw_max; m<=hw_max; m++)
+    {
+      t[m] = pixon_table.value(ip, m);
+      norm[ip] += t[m];
+    }
+  }
 }
 
-DataFFT::DataFFT(int nd_in, double fft_dx, int npad_in)
-      :nd(nd_in), npad(npad_in) 
+/* 
+ * direct convolution of the zero-padded image pad (with hw_max points each side) 
+ * with taps t over pixels [j0, j1), conv[j] = sum_m t[m] * img[j-m].
+ * the inner loop runs over contiguous pixels and vectorizes.
+ */
+static void convolve_taps(const double *pad, int hw_max, const double *t, int hw, int j0, int j1, double *conv)
 {
-  int i;
+  int j, m;
+  double w;
+  const double *src;
 
-  nd_fft = nd + npad;
-  nd_fft_cal = nd_fft/2 + 1;
-
-  data_fft = (fftw_complex *) fftw_malloc((nd_fft_cal) * sizeof(fftw_complex));
-  resp_fft = (fftw_complex *) fftw_malloc((nd_fft_cal) * sizeof(fftw_complex));
-  conv_fft = (fftw_complex *) fftw_malloc((nd_fft_cal) * sizeof(fftw_complex));
+  for(j=j0; j<j1; j++)
+  {
+    conv[j] = 0.0;
+  }
+  for(m=-hw; m<=hw; m++)
+  {
+    w = t[m];
+    src = pad + hw_max - m;
+    for(j=j0; j<j1; j++)
+    {
+      conv[j] += w * src[j];
+    }
+  }
+}
 
-  data_real = new double[nd_fft];
-  resp_real = new double[nd_fft];
-  conv_real = new double[nd_fft];
-      
-  pdata = fftw_plan_dft_r2c_1d(nd_fft, data_real, data_fft, FFTW_PATIENT);
-  presp = fftw_plan_dft_r2c_1d(nd_fft, resp_real, resp_fft, FFTW_PATIENT);
-  pback = fftw_plan_dft_c2r_1d(nd_fft, conv_fft, conv_real, FFTW_PATIENT);
-      
-  /* normalization */
-  fft_norm = fft_dx/nd_fft;
+/* 
+ * transpose of convolve_taps, accumulate img[j]*t[m] to pad at pixel j+m for j in [j0, j1),
+ * pad has hw_max points each side.
+ */
+static void convolve_taps_transpose(const double *img, const double *t, int hw, double scale, 
+                                    int j0, int j1, double *pad, int hw_max)
+{
+  int j, m;
+  double w;
+  double *dst;
 
-  for(i=0; i < nd_fft; i++)
+  for(m=-hw; m<=hw; m++)
   {
-    data_real[i] = resp_real[i] = conv_real[i] = 0.0;
+    w = t[m] * scale;
+    dst = pad + hw_max + m;
+    for(j=j0; j<j1; j++)
+    {
+      dst[j] += w * img[j];
+    }
   }
 }
 
-DataFFT::DataFFT(Data& cont, int npad_in)
-      :nd(cont.size), npad(npad_in)
+/*==================================================================*/
+/* copy between double arrays and FFT buffers, which may be single precision */
+static inline void copy_fft_in(fft_real *dst, const double *src, int n)
 {
   int i;
+  for(i=0; i<n; i++)
+  {
+    dst[i] = src[i];
+  }
+}
+
+static inline void copy_fft_out(double *dst, const fft_real *src, int n)
+{
+  int i;
+  for(i=0; i<n; i++)
+  {
+    dst[i] = src[i];
+  }
+}
+
+/* 
+ * smallest length not less than n of the form 2^a*3^b*5^c*7^d, 
+ * for which FFTW has fast codelets.
+ */
+int next_fft_size(int n)
+{
+  int m, k;
+  if(n <= 1)
+    return 1;
+
+  for(k=n; ; k++)
+  {
+    m = k;
+    while(m%2 == 0) m /= 2;
+    while(m%3 == 0) m /= 3;
+    while(m%5 == 0) m /= 5;
+    while(m%7 == 0) m /= 7;
+    if(m == 1)
+      return k;
+  }
+}
+
+/*==================================================================*/
+/* class DataFFT */
+DataFFT::DataFFT()
+{
+  nd = npad = nd_fft = nd_fft_cal = 0;
+  data_fft = resp_fft = conv_fft = NULL;
+  data_real = resp_real = conv_real = NULL;
+  pforward = pbackward = NULL;
+  cost_fft = cost_tap = ops_fft = 0.0;
+}
+
+DataFFT::DataFFT(int nd_in, double fft_dx, int npad_in)
+      :nd(nd_in), npad(npad_in) 
+{
+  int i;
+
+  /* round up to a length FFTW handles fast, extra points go to padding */
+  nd_fft = next_fft_size(nd + npad);
+  npad = nd_fft - nd;
+  nd_fft_cal = nd_fft/2 + 1;
+
+  data_fft = (fft_complex *) fft_malloc((nd_fft_cal) * sizeof(fft_complex));
+  resp_fft = (fft_complex *) fft_malloc((nd_fft_cal) * sizeof(fft_complex));
+  conv_fft = (fft_complex *) fft_malloc((nd_fft_cal) * sizeof(fft_complex));
+
+  data_real = (fft_real *) fft_malloc(nd_fft * sizeof(fft_real));
+  resp_real = (fft_real *) fft_malloc(nd_fft * sizeof(fft_real));
+  conv_real = (fft_real *) fft_malloc(nd_fft * sizeof(fft_real));
+      
+  /* shared plans, buffers from fft_malloc are aligned */
+  pforward = get_fft_plan(nd_fft, FFT_R2C);
+  pbackward = get_fft_plan(nd_fft, FFT_C2R);
+      
+  /* normalization */
+  fft_norm = fft_dx/nd_fft;
+  cost_fft = cost_tap = ops_fft = 0.0;
+
+  for(i=0; i < nd_fft; i++)
+  {
+    data_real[i] = resp_real[i] = conv_real[i] = 0.0;
+  }
+}
 
-  nd_fft = nd + npad;
-  nd_fft_cal = nd_fft/2 + 1;
-
-  data_fft = (fftw_complex *) fftw_malloc((nd_fft_cal) * sizeof(fftw_complex));
-  resp_fft = (fftw_complex *) fftw_malloc((nd_fft_cal) * sizeof(fftw_complex));
-  conv_fft = (fftw_complex *) fftw_malloc((nd_fft_cal) * sizeof(fftw_complex));
+DataFFT::DataFFT(Data& cont, int npad_in)
+      :nd(cont.size), npad(npad_in)
+{
+  int i;
 
-  data_real = new double[nd_fft];
-  resp_real = new double[nd_fft];
-  conv_real = new double[nd_fft];
+  /* round up to a length FFTW handles fast, extra points go to padding */
+  nd_fft = next_fft_size(nd + npad);
+  npad = nd_fft - nd;
+  nd_fft_cal = nd_fft/2 + 1;
+
+  data_fft = (fft_complex *) fft_malloc((nd_fft_cal) * sizeof(fft_complex));
+  resp_fft = (fft_complex *) fft_malloc((nd_fft_cal) * sizeof(fft_complex));
+  conv_fft = (fft_complex *) fft_malloc((nd_fft_cal) * sizeof(fft_complex));
+
+  data_real = (fft_real *) fft_malloc(nd_fft * sizeof(fft_real));
+  resp_real = (fft_real *) fft_malloc(nd_fft * sizeof(fft_real));
+  conv_real = (fft_real *) fft_malloc(nd_fft * sizeof(fft_real));
       
-  pdata = fftw_plan_dft_r2c_1d(nd_fft, data_real, data_fft, FFTW_PATIENT);
-  presp = fftw_plan_dft_r2c_1d(nd_fft, resp_real, resp_fft, FFTW_PATIENT);
-  pback = fftw_plan_dft_c2r_1d(nd_fft, conv_fft, conv_real, FFTW_PATIENT);
+  /* shared plans, buffers from fft_malloc are aligned */
+  pforward = get_fft_plan(nd_fft, FFT_R2C);
+  pbackward = get_fft_plan(nd_fft, FFT_C2R);
       
   fft_norm = (cont.time[1] - cont.time[0]) / nd_fft;
+  cost_fft = cost_tap = ops_fft = 0.0;
 
   for(i=0; i < nd_fft; i++)
   {
@@ -514,38 +1134,36 @@ DataFFT& DataFFT::operator = (DataFFT& df)
   {
     if(nd > 0)
     {
-      fftw_free(data_fft);
-      fftw_free(resp_fft);
-      fftw_free(conv_fft);
+      fft_free(data_fft);
+      fft_free(resp_fft);
+      fft_free(conv_fft);
 
-      delete[] data_real;
-      delete[] resp_real;
-      delete[] conv_real;
-
-      fftw_destroy_plan(pdata);
-      fftw_destroy_plan(presp);
-      fftw_destroy_plan(pback);
+      fft_free(data_real);
+      fft_free(resp_real);
+      fft_free(conv_real);
     }
         
     int i;
     nd = df.nd;
     npad = df.npad;
-    nd_fft = nd + npad;
+    nd_fft = df.nd_fft;
     nd_fft_cal = nd_fft/2 + 1;
   
-    data_fft = (fftw_complex *) fftw_malloc((nd_fft_cal) * sizeof(fftw_complex));
-    resp_fft = (fftw_complex *) fftw_malloc((nd_fft_cal) * sizeof(fftw_complex));
-    conv_fft = (fftw_complex *) fftw_malloc((nd_fft_cal) * sizeof(fftw_complex));
+    data_fft = (fft_complex *) fft_malloc((nd_fft_cal) * sizeof(fft_complex));
+    resp_fft = (fft_complex *) fft_malloc((nd_fft_cal) * sizeof(fft_complex));
+    conv_fft = (fft_complex *) fft_malloc((nd_fft_cal) * sizeof(fft_complex));
   
-    data_real = new double[nd_fft];
-    resp_real = new double[nd_fft];
-    conv_real = new double[nd_fft];
+    data_real = (fft_real *) fft_malloc(nd_fft * sizeof(fft_real));
+    resp_real = (fft_real *) fft_malloc(nd_fft * sizeof(fft_real));
+    conv_real = (fft_real *) fft_malloc(nd_fft * sizeof(fft_real));
         
-    pdata = fftw_plan_dft_r2c_1d(nd_fft, data_real, data_fft, FFTW_PATIENT);
-    presp = fftw_plan_dft_r2c_1d(nd_fft, resp_real, resp_fft, FFTW_PATIENT);
-    pback = fftw_plan_dft_c2r_1d(nd_fft, conv_fft, conv_real, FFTW_PATIENT);
+    pforward = get_fft_plan(nd_fft, FFT_R2C);
+    pbackward = get_fft_plan(nd_fft, FFT_C2R);
         
     fft_norm = df.fft_norm;
+    cost_fft = df.cost_fft;
+    ops_fft = df.ops_fft;
+    cost_tap = df.cost_tap;
   
     for(i=0; i < nd_fft; i++)
     {
@@ -561,95 +1179,233 @@ DataFFT::~DataFFT()
   {
     nd = 0;
 
-    fftw_free(data_fft);
-    fftw_free(resp_fft);
-    fftw_free(conv_fft);
-
-    delete[] data_real;
-    delete[] resp_real;
-    delete[] conv_real;
+    fft_free(data_fft);
+    fft_free(resp_fft);
+    fft_free(conv_fft);
 
-    fftw_destroy_plan(pdata);
-    fftw_destroy_plan(presp);
-    fftw_destroy_plan(pback);
+    fft_free(data_real);
+    fft_free(resp_real);
+    fft_free(conv_real);
   }
 }
 
 /* convolution with resp, output to conv */
-void DataFFT::convolve_simple(double *conv)
+void DataFFT::convolve_simple(double *conv, double bg)
+{
+  convolve_simple(resp_fft, conv, bg);
+}
+
+/* 
+ * convolution with a given spectrum of resp, output to conv, plus a background bg.
+ * the normalization and an extra scale are folded into the spectrum product and 
+ * the background into the copy-out, so the output is touched only once.
+ */
+void DataFFT::convolve_simple(const fft_complex *spec, double *conv, double bg, double scale)
 {
   int i;
+  spectrum_mul(data_fft, spec, fft_norm * scale, conv_fft, nd_fft_cal);
+  fft_execute_dft_c2r(pbackward, conv_fft, conv_real);
+
+  /* copy back, the padded points are discarded */
+  for(i=0; i<nd; i++)
+  {
+    conv[i] = conv_real[i] + bg;
+  }
+}
+
+/* 
+ * costs of direct versus FFT convolution per transform length and number of FFTW threads,
+ * timed once per process, so that all objects of the same grid make the same choices.
+ */
+typedef pair<int, int> conv_cost_key;
+static map<conv_cost_key, pair<double, double> > conv_cost_registry;
+static mutex conv_cost_mutex;
+
+/* 
+ * set the cost model of direct versus FFT convolution on this grid, 
+ * cost_fft is the cost of one real transform and cost_tap that of 
+ * one multiply-add of the direct convolution.
+ * by default from operation counts, a real transform of length n takes about 
+ * FFT_COST_FACTOR * n*log2(n) multiply-adds of the vectorized direct loop.
+ * with conv_cost = timed, from the minimum time over a few repeats.
+ */
+void DataFFT::calibrate_cost()
+{
+  ops_fft = FFT_COST_FACTOR * nd_fft * log2((double)nd_fft);
+  if(!conv_cost_timed)
+  {
+    cost_tap = 1.0;
+    cost_fft = ops_fft;
+    return;
+  }
+
+  int nthreads = (nd_fft >= fft_thread_min) ? fft_nthreads : 1;
+  conv_cost_key key = make_pair(nd_fft, nthreads);
+  lock_guard<mutex> lock(conv_cost_mutex);
+  map<conv_cost_key, pair<double, double> >::iterator it = conv_cost_registry.find(key);
+  if(it != conv_cost_registry.end())
+  {
+    cost_fft = it->second.first;
+    cost_tap = it->second.second;
+    return;
+  }
+
+  int i, rep, nrep = 5, hw, nj;
+  double t, tap[17];
+  double *src = new double[nd_fft], *dst = new double[nd_fft];
+
+  hw = (npad/2 < 8)?npad/2:8;
+  nj = nd_fft - 2*hw;
+  for(i=0; i<2*hw+1; i++)
+  {
+    tap[i] = 1.0/(2*hw+1);
+  }
+  for(i=0; i<nd_fft; i++)
+  {
+    resp_real[i] = 0.0;
+    src[i] = 0.0;
+  }
   for(i=0; i<nd_fft_cal; i++)
   {
-    conv_fft[i][0] = data_fft[i][0]*resp_fft[i][0] - data_fft[i][1]*resp_fft[i][1];
-    conv_fft[i][1] = data_fft[i][0]*resp_fft[i][1] + data_fft[i][1]*resp_fft[i][0];
+    conv_fft[i][0] = conv_fft[i][1] = 0.0;
+  }
+
+  cost_fft = cost_tap = HUGE_VAL;
+  for(rep=0; rep<nrep; rep++)
+  {
+    auto start = chrono::steady_clock::now();
+    fft_execute_dft_r2c(pforward, resp_real, resp_fft);
+    fft_execute_dft_c2r(pbackward, conv_fft, conv_real);
+    auto end = chrono::steady_clock::now();
+    t = chrono::duration<double>(end - start).count()/2.0;
+    cost_fft = fmin(cost_fft, t);
+
+    start = chrono::steady_clock::now();
+    convolve_taps(src, hw, tap+hw, hw, 0, nj, dst);
+    end = chrono::steady_clock::now();
+    t = chrono::duration<double>(end - start).count()/(nj*(2*hw+1));
+    cost_tap = fmin(cost_tap, t);
   }
-  fftw_execute(pback);
 
-  /* normalize */
   for(i=0; i<nd_fft; i++)
   {
-    conv_real[i] *= fft_norm;
+    resp_real[i] = conv_real[i] = 0.0;
   }
+  delete[] src;
+  delete[] dst;
 
-  /* copy back, the first npad points are discarded */
-   memcpy(conv, conv_real, nd*sizeof(double));      
-   return;
+  conv_cost_registry[key] = make_pair(cost_fft, cost_tap);
 }
 
 void DataFFT::set_resp_real(const double *resp, int nall, int ipositive)
 {
   /* positive-lag part */
-  memcpy(resp_real, resp+ipositive, (nall - ipositive)*sizeof(double));
+  copy_fft_in(resp_real, resp+ipositive, nall - ipositive);
 
-  /* negative-lag part */
+  /* zero the gap between positive and negative lags */
   int i; 
+  for(i=nall-ipositive; i<nd_fft-ipositive; i++)
+  {
+    resp_real[i] = 0.0;
+  }
+
+  /* negative-lag part */
   for(i=0; i<ipositive; i++)
   {
     resp_real[nd_fft-ipositive+i] = resp[i];
   }
-  fftw_execute(presp);
+  fft_execute_dft_r2c(pforward, resp_real, resp_fft);
 }
 
 /*==================================================================*/
 /* class RMFFT */
+RMFFT::RMFFT()
+{
+  reference = false;
+  data_ref = NULL;
+}
+
 RMFFT::RMFFT(int n, double dx, int npad_in)
       :DataFFT(n, dx, npad_in)
 {
+  int i;
+  reference = false;
+  data_ref = new double[nd];
+  for(i=0; i<nd; i++)
+  {
+    data_ref[i] = 0.0;
+  }
 }
 
 RMFFT::RMFFT(int n, double *cont, double dx, int npad_in)
       :DataFFT(n, dx, npad_in)
 {
+  reference = false;
+  data_ref = new double[nd];
+  memcpy(data_ref, cont, nd*sizeof(double));
+
   /* fft of cont setup only once */
-  memcpy(data_real, cont, nd*sizeof(double));
-  fftw_execute(pdata);
+  copy_fft_in(data_real, cont, nd);
+  fft_execute_dft_r2c(pforward, data_real, data_fft);
 }
     
 RMFFT::RMFFT(Data& cont, int npad_in):DataFFT(cont, npad_in)
 {
-  memcpy(data_real, cont.flux, nd*sizeof(double));
-  fftw_execute(pdata);
+  reference = false;
+  data_ref = new double[nd];
+  memcpy(data_ref, cont.flux, nd*sizeof(double));
+
+  copy_fft_in(data_real, cont.flux, nd);
+  fft_execute_dft_r2c(pforward, data_real, data_fft);
+
+  calibrate_cost();
+}
+
+RMFFT::RMFFT(const RMFFT& rm)
+      :DataFFT(rm.nd, rm.fft_norm * rm.nd_fft, rm.npad)
+{
+  reference = rm.reference;
+  data_ref = new double[nd];
+  set_data(rm);
+  cost_fft = rm.cost_fft;
+  ops_fft = rm.ops_fft;
+  cost_tap = rm.cost_tap;
+}
+
+RMFFT::~RMFFT()
+{
+  if(data_ref != NULL)
+  {
+    delete[] data_ref;
+  }
 }
 
 void RMFFT::set_data(Data & cont)
 {
-  memcpy(data_real, cont.flux, cont.size*sizeof(double));
-  fftw_execute(pdata);
+  memcpy(data_ref, cont.flux, cont.size*sizeof(double));
+  copy_fft_in(data_real, cont.flux, cont.size);
+  fft_execute_dft_r2c(pforward, data_real, data_fft);
 }
 
 void RMFFT::set_data(double *data, int n)
 {
-  memcpy(data_real, data, n*sizeof(double));
-  fftw_execute(pdata);
+  memcpy(data_ref, data, n*sizeof(double));
+  copy_fft_in(data_real, data, n);
+  fft_execute_dft_r2c(pforward, data_real, data_fft);
+}
+
+void RMFFT::set_data(const RMFFT& rm)
+{
+  memcpy(data_ref, rm.data_ref, nd*sizeof(double));
+  memcpy(data_fft, rm.data_fft, nd_fft_cal*sizeof(fft_complex));
 }
 
 /* convolution with resp, output to conv */
 void RMFFT::convolve(const double *resp, int n, double *conv)
 {
   /* fft of resp */
-  memcpy(resp_real, resp, n * sizeof(double));
-  fftw_execute(presp);
+  copy_fft_in(resp_real, resp, n);
+  fft_execute_dft_r2c(pforward, resp_real, resp_fft);
   
   DataFFT::convolve_simple(conv);
   return;
@@ -659,186 +1415,570 @@ void RMFFT::convolve(const double *resp, int n, double *conv)
 void RMFFT::convolve_bg(const double *resp, int n, double *conv, double bg)
 {
   /* fft of resp */
-  memcpy(resp_real, resp, n * sizeof(double));
-  fftw_execute(presp);
+  copy_fft_in(resp_real, resp, n);
+  fft_execute_dft_r2c(pforward, resp_real, resp_fft);
   
-  DataFFT::convolve_simple(conv);
-
-  int i;
-  for(i=0; i<nd; i++)
-  {
-    conv[i] += bg;
-  }
+  DataFFT::convolve_simple(conv, bg);
   return;
 }
 
 /* convolution with resp, output to conv */
 void RMFFT::convolve_bg(const double *resp, int n, int ipositive, double *conv, double bg)
 {
+  if(reference)
+  {
+    convolve_bg_direct(resp, n, ipositive, conv, bg);
+    return;
+  }
+
   /* fft of resp */
   set_resp_real(resp, n, ipositive);
   
-  DataFFT::convolve_simple(conv);
+  DataFFT::convolve_simple(conv, bg);
+  return;
+}
+
+/* direct convolution in double with the same lag layout as convolve_bg, 
+ * conv[i] = dx * sum_j resp[j] * data[i - (j-ipositive)] + bg
+ */
+void RMFFT::convolve_bg_direct(const double *resp, int n, int ipositive, double *conv, double bg)
+{
+  int i, j, k;
+  double sum, dx = fft_norm * nd_fft;
 
-  int i;
   for(i=0; i<nd; i++)
   {
-    conv[i] += bg;
+    sum = 0.0;
+    for(j=0; j<n; j++)
+    {
+      k = i - j + ipositive;
+      if(k >= 0 && k < nd)
+        sum += resp[j] * data_ref[k];
+    }
+    conv[i] = sum * dx + bg;
   }
+}
+
+/* 
+ * update of convolve_bg after resp changes by dresp[k] at pixel list[k], done directly in double,
+ * conv[i] += dx * sum_k dresp[k] * data[i - (list[k]-ipositive)]
+ */
+void RMFFT::convolve_update(const int *list, const double *dresp, int nlist, int ipositive, double *conv)
+{
+  int i, i0, i1, k, lag;
+  double w, dx = fft_norm * nd_fft;
+
+  for(k=0; k<nlist; k++)
+  {
+    lag = list[k] - ipositive;
+    w = dresp[k] * dx;
+    i0 = (lag > 0)?lag:0;
+    i1 = (lag < 0)?nd+lag:nd;
+    for(i=i0; i<i1; i++)
+    {
+      conv[i] += w * data_ref[i - lag];
+    }
+  }
+}
+
+/* 
+ * whether convolve_update over nlist pixels is cheaper than the two transforms of convolve_bg,
+ * from operation counts also with conv_cost = timed, the update and the transforms differ 
+ * at round-off, so the choice must not depend on timings.
+ */
+bool RMFFT::use_update(int nlist)
+{
+  return nlist * nd < 2.0 * ops_fft;
+}
+
+/* correlation of g with data, output to corr
+ * corr[j] = sum_i g[i] * data[i - (j-ipositive)], j=0,...,n-1
+ * this is the adjoint of convolve_bg(resp, n, ipositive, ...) with respect to resp.
+ * note resp_real is overwritten.
+ */
+void RMFFT::correlate_data(const double *g, int n, int ipositive, double *corr)
+{
+  int i, j;
+  
+  /* fft of g */
+  copy_fft_in(resp_real, g, nd);
+  for(i=nd; i<nd_fft; i++)
+  {
+    resp_real[i] = 0.0;
+  }
+  fft_execute_dft_r2c(pforward, resp_real, resp_fft);
+
+  spectrum_mul_conj(resp_fft, data_fft, fft_norm, conv_fft, nd_fft_cal);
+  fft_execute_dft_c2r(pbackward, conv_fft, conv_real);
+
+  /* negative lags are wrapped to the end */
+  for(j=0; j<ipositive; j++)
+  {
+    corr[j] = conv_real[nd_fft-ipositive+j];
+  }
+  for(j=ipositive; j<n; j++)
+  {
+    corr[j] = conv_real[j-ipositive];
+  }
+  return;
+}
+
+/* correlation of g with resp, output to corr
+ * corr[i] = sum_j g[j] * resp[j-i], i=0,...,nd-1 
+ * this is the adjoint of convolve_bg with respect to data.
+ * resp must be set before with set_resp_real; note data_real is overwritten.
+ */
+void RMFFT::correlate_resp(const double *g, double *corr)
+{
+  /* fft of g */
+  copy_fft_in(data_real, g, nd);
+  fft_execute_dft_r2c(pforward, data_real, data_fft);
+
+  spectrum_mul_conj(data_fft, resp_fft, fft_norm, conv_fft, nd_fft_cal);
+  fft_execute_dft_c2r(pbackward, conv_fft, conv_real);
+
+  copy_fft_out(corr, conv_real, nd);
   return;
 }
 
 /*==================================================================*/
 /* class PixonFFT */
+
+/* setup pixon kernel of size index ip on a grid of n points from the kernel table, 
+ * negative offsets are wrapped to the end, return the kernel normalization 
+ */
+static double set_pixon_kernel(const PixonKernelTable &pixon_table, fft_real *resp, int n, int ip)
+{
+  int j;
+  double k, norm = 0.0;
+  for(j=0; j<n/2; j++)
+  {
+    k = pixon_table.value(ip, j);
+    resp[j] = k;
+    norm += k;
+  }
+  for(j=n-1; j>=n/2; j--)
+  {
+    k = pixon_table.value(ip, n-j);
+    resp[j] = k;
+    norm += k;
+  }
+  return norm;
+}
+
 PixonFFT::PixonFFT()
 {
+  ctx = NULL;
+  conv_mode = PIXON_CONV_AUTO;
   npixon_size_max = ipixon_min = 0;
   pixon_sizes = NULL;
   pixon_sizes_num = NULL;
-  conv_tmp = NULL;
-}
-PixonFFT::PixonFFT(int npixel_in, int npixon_size_max_in)
-      :DataFFT(npixel_in, 1.0, npixon_size_max_in*pixon_size_factor), npixon_size_max(npixon_size_max_in)
-{
-  int i;
+  kernel_ipixon_min = 0;
+  kernel_fft = kernel_fft_low = kernel_fft_up = NULL;
+  kernel_norm = NULL;
+  batch_ipixon = batch_slot = NULL;
+  batch_fft = NULL;
+  batch_real = NULL;
+  pback_batch = pdata_batch = NULL;
+  batch_spec_in = batch_spec_kernel = NULL;
+  batch_scale = NULL;
+  tap_hw_max = 0;
+  tap_hw = tap_hw_up = NULL;
+  taps = taps_low = taps_up = tap_norm = NULL;
+  pad_real = NULL;
+}
+PixonFFT::PixonFFT(const PixonContext& ctx_in, int npixel_in, int npixon_size_max_in)
+      :DataFFT(npixel_in, 1.0, npixon_size_max_in*ctx_in.pixon_size_factor), 
+       ctx(&ctx_in), conv_mode(ctx_in.conv_mode), npixon_size_max(npixon_size_max_in)
+{
+  int i, ip, m, ntap;
 
   ipixon_min = npixon_size_max-1;
   pixon_sizes = new double[npixon_size_max];
   pixon_sizes_num = new double[npixon_size_max];
-  conv_tmp = new double[nd];
   for(i=0; i<npixon_size_max; i++)
   {
-    pixon_sizes[i] = (i+1)*1.0/pixon_sub_factor;
+    pixon_sizes[i] = (i+1)*1.0/ctx->pixon_sub_factor;
     pixon_sizes_num[i] = 0;
   }
   /* assume that all pixels have the largest pixon size */
   pixon_sizes_num[ipixon_min] = npixel_in;
+
+  /* kernel cache, filled on demand */
+  kernel_ipixon_min = npixon_size_max;
+  kernel_fft = (fft_complex *) fft_malloc(npixon_size_max * nd_fft_cal * sizeof(fft_complex));
+  kernel_fft_low = (fft_complex *) fft_malloc(npixon_size_max * nd_fft_cal * sizeof(fft_complex));
+  kernel_fft_up = (fft_complex *) fft_malloc(npixon_size_max * nd_fft_cal * sizeof(fft_complex));
+  kernel_norm = new double[npixon_size_max];
+
+  /* batch of all pixon sizes */
+  batch_ipixon = new int[npixon_size_max];
+  batch_slot = new int[npixon_size_max];
+  batch_fft = (fft_complex *) fft_malloc(npixon_size_max * nd_fft_cal * sizeof(fft_complex));
+  batch_real = (fft_real *) fft_malloc(npixon_size_max * nd_fft * sizeof(fft_real));
+  batch_spec_in = new const fft_complex *[npixon_size_max];
+  batch_spec_kernel = new const fft_complex *[npixon_size_max];
+  batch_scale = new double[npixon_size_max];
+  pback_batch = new fft_plan[npixon_size_max+1];
+  pdata_batch = new fft_plan[npixon_size_max+1];
+  for(i=0; i<=npixon_size_max; i++)
+  {
+    pback_batch[i] = pdata_batch[i] = NULL;
+  }
+
+  /* kernel taps for direct convolution */
+  tap_hw = new int[npixon_size_max];
+  tap_hw_up = new int[npixon_size_max];
+  tap_norm = new double[npixon_size_max];
+  tap_hw_max = (int)(ctx->pixon_size_factor * pixon_sizes[npixon_size_max-1]);
+  ntap = 2*tap_hw_max + 1;
+  taps = new double[npixon_size_max * ntap];
+  taps_low = new double[npixon_size_max * ntap];
+  taps_up = new double[npixon_size_max * ntap];
+  set_pixon_taps(*ctx, npixon_size_max, tap_hw_max, taps_low, tap_hw, tap_norm);
+  /* differences with neighbouring sizes, the same as the cached spectra */
+  for(ip=0; ip<npixon_size_max; ip++)
+  {
+    tap_hw_up[ip] = (ip < npixon_size_max-1)?tap_hw[ip+1]:tap_hw[ip];
+    for(m=0; m<ntap; m++)
+    {
+      taps[ip*ntap + m] = taps_low[ip*ntap + m]/tap_norm[ip];
+      taps_up[ip*ntap + m] = taps_low[ip*ntap + m];
+      if(ip < npixon_size_max-1)
+        taps_up[ip*ntap + m] -= taps_low[(ip+1)*ntap + m];
+    }
+  }
+  for(ip=npixon_size_max-1; ip>0; ip--)
+  {
+    for(m=0; m<ntap; m++)
+    {
+      taps_low[ip*ntap + m] -= taps_low[(ip-1)*ntap + m];
+    }
+  }
+  pad_real = new double[nd + 2*tap_hw_max];
+  for(i=0; i<nd + 2*tap_hw_max; i++)
+  {
+    pad_real[i] = 0.0;
+  }
+
+  calibrate_cost();
 }
 
 PixonFFT::~PixonFFT()
 {
   if(npixon_size_max > 0)
   {
+    /* batched plans are owned by the registry */
+    delete[] batch_spec_in;
+    delete[] batch_spec_kernel;
+    delete[] batch_scale;
+    delete[] pback_batch;
+    delete[] pdata_batch;
+    delete[] batch_ipixon;
+    delete[] batch_slot;
+    fft_free(batch_fft);
+    fft_free(batch_real);
+
+    delete[] tap_hw;
+    delete[] tap_hw_up;
+    delete[] tap_norm;
+    delete[] taps;
+    delete[] taps_low;
+    delete[] taps_up;
+    delete[] pad_real;
+
     npixon_size_max = 0;
     delete[] pixon_sizes;
     delete[] pixon_sizes_num;
-    delete[] conv_tmp;
+    fft_free(kernel_fft);
+    fft_free(kernel_fft_low);
+    fft_free(kernel_fft_up);
+    delete[] kernel_norm;
   }
 }
 
-void PixonFFT::convolve(const double *pseudo_img, int *pixon_map, double *conv)
+/* 
+ * compute the spectra of pixon kernels that are not yet in the cache.
+ * the kernels only depend on pixon sizes, so the cache is extended 
+ * only when the minimum pixon size is reduced.
+ * the kernel at ipixon_min-1 is also needed for the low differences.
+ */
+void PixonFFT::update_kernel_cache()
 {
-  int ip, j;
-  double psize, norm;
+  int ip, ip_low;
+  fft_complex *spec, *spec_low, *spec_up;
+  double norm;
 
-  /* fft of pseudo image */
-  memcpy(data_real, pseudo_img, nd*sizeof(double));
-  fftw_execute(pdata);
+  ip_low = (ipixon_min > 0)?ipixon_min-1:0;
+  if(ip_low >= kernel_ipixon_min)
+    return;
 
-  /* loop over all pixon sizes */
-  for(ip=ipixon_min; ip<npixon_size_max; ip++)
+  /* normalized kernel spectra */
+  for(ip=kernel_ipixon_min-1; ip>=ip_low; ip--)
   {
-    if(pixon_sizes_num[ip] > 0)
+    norm = set_pixon_kernel(ctx->pixon_table, resp_real, nd_fft, ip);
+    fft_execute_dft_r2c(pforward, resp_real, resp_fft);
+
+    spectrum_scale(resp_fft, 1.0/norm, kernel_fft + ip*nd_fft_cal, nd_fft_cal);
+    kernel_norm[ip] = norm;
+  }
+  kernel_ipixon_min = ip_low;
+
+  /* spectra of kernel differences with neighbouring sizes, kernels not normalized */
+  for(ip=kernel_ipixon_min; ip<npixon_size_max; ip++)
+  {
+    spec = kernel_fft + ip*nd_fft_cal;
+    spec_low = kernel_fft_low + ip*nd_fft_cal;
+    spec_up = kernel_fft_up + ip*nd_fft_cal;
+    spectrum_scale(spec, kernel_norm[ip], spec_low, nd_fft_cal);
+    spectrum_scale(spec, kernel_norm[ip], spec_up, nd_fft_cal);
+    if(ip > kernel_ipixon_min)
     {
-      psize = pixon_sizes[ip];
-      /* setup resp */
-      norm = 0.0;
-      for(j=0; j<nd_fft/2; j++)
-      {
-        resp_real[j] = pixon_function(j, 0, psize);
-        norm += resp_real[j];
-      }
-      for(j=nd_fft-1; j>=nd_fft/2; j--)
-      {
-        resp_real[j] = pixon_function(j, nd_fft, psize);
-        norm += resp_real[j];
-      }
-      fftw_execute(presp);
-      
-      DataFFT::convolve_simple(conv_tmp);
-      for(j=0; j<nd; j++)
-      {
-        if(pixon_map[j] == ip)
-          conv[j] = conv_tmp[j] / norm;
-      }
+      spectrum_axpy(kernel_fft + (ip-1)*nd_fft_cal, -kernel_norm[ip-1], spec_low, nd_fft_cal);
+    }
+    if(ip < npixon_size_max-1)
+    {
+      spectrum_axpy(kernel_fft + (ip+1)*nd_fft_cal, -kernel_norm[ip+1], spec_up, nd_fft_cal);
     }
   }
 }
 
-void PixonFFT::convolve_pixon_diff_low(const double *pseudo_img, int *pixon_map, double *conv)
+/* 
+ * whether pixon size ip is convolved directly, from the cost model calibrated at 
+ * construction: direct taps over the pixels of this size against one more transform 
+ * in the batch.
+ */
+bool PixonFFT::use_direct(int ip)
 {
-  int ip, j;
-  double psize, psize_low;
+  if(conv_mode == PIXON_CONV_FFT)
+    return false;
+  if(conv_mode == PIXON_CONV_DIRECT)
+    return true;
 
-  /* fft of pseudo image */
-  memcpy(data_real, pseudo_img, nd*sizeof(double));
-  fftw_execute(pdata);
+  return pixon_sizes_num[ip] * (2*tap_hw_up[ip]+1) * cost_tap < cost_fft;
+}
 
-  /* loop over all pixon sizes */
+/* 
+ * set up the list of active pixon sizes done with FFT and the batched FFT plans for them,
+ * sizes convolved directly get a slot of -1. return the number of sizes in the batch.
+ */
+int PixonFFT::set_batch()
+{
+  int ip, nbatch;
+
+  nbatch = 0;
   for(ip=ipixon_min; ip<npixon_size_max; ip++)
   {
     if(pixon_sizes_num[ip] > 0)
     {
-      psize = pixon_sizes[ip];
-      psize_low = pixon_sizes[ip-1];
-      /* setup resp */
-      for(j=0; j<nd_fft/2; j++)
-      {
-        resp_real[j] = pixon_function(j, 0, psize) - pixon_function(j, 0, psize_low);
-      }
-      for(j=nd_fft-1; j>=nd_fft/2; j--)
-      {
-        resp_real[j] = pixon_function(j, nd_fft, psize) - pixon_function(j, nd_fft, psize_low);
-      }
-      fftw_execute(presp);
-      
-      DataFFT::convolve_simple(conv_tmp);
-      for(j=0; j<nd; j++)
+      if(use_direct(ip))
       {
-        if(pixon_map[j] == ip)
-          conv[j] = conv_tmp[j];
+        batch_slot[ip] = -1;
+        continue;
       }
+      batch_ipixon[nbatch] = ip;
+      batch_slot[ip] = nbatch;
+      nbatch++;
     }
   }
+
+  /* plans are fetched from the registry when a batch size first appears */
+  if(nbatch > 0 && pback_batch[nbatch] == NULL)
+  {
+    pback_batch[nbatch] = get_fft_plan(nd_fft, FFT_C2R, nbatch);
+    pdata_batch[nbatch] = get_fft_plan(nd_fft, FFT_R2C, nbatch);
+  }
+  return nbatch;
 }
 
-void PixonFFT::convolve_pixon_diff_up(const double *pseudo_img, int *pixon_map, double *conv)
+/* 
+ * transform the image for the convolutions with the kernels of all active pixon sizes,
+ * the forward FFT is only needed when some sizes are in the batch.
+ */
+void PixonFFT::transform_image(const double *pseudo_img, int nbatch)
 {
-  int ip, j;
-  double psize, psize_up;
+  if(nbatch > 0)
+  {
+    copy_fft_in(data_real, pseudo_img, nd);
+    fft_execute_dft_r2c(pforward, data_real, data_fft);
+  }
+  memcpy(pad_real + tap_hw_max, pseudo_img, nd*sizeof(double));
+}
 
-  /* fft of pseudo image */
-  memcpy(data_real, pseudo_img, nd*sizeof(double));
-  fftw_execute(pdata);
+/* 
+ * convolution of the transformed image with the kernels of all active pixon sizes.
+ * sizes in the batch are done in one batched FFT, the output at each pixel is picked 
+ * from its own pixon size; the other sizes are convolved directly with the taps 
+ * over runs of pixels with the same size.
+ */
+void PixonFFT::convolve_batch(const fft_complex *kernels, const double *taps_all, const int *hw, 
+                              const int *pixon_map, int nbatch, double *conv)
+{
+  int k, j, j1, ip;
 
-  /* loop over all pixon sizes */
-  for(ip=ipixon_min; ip<npixon_size_max; ip++)
+  if(nbatch > 0)
   {
-    if(pixon_sizes_num[ip] > 0)
+    /* spectrum products of all sizes in the batch, including normalization */
+    for(k=0; k<nbatch; k++)
     {
-      psize = pixon_sizes[ip];
-      psize_up = pixon_sizes[ip+1];
-      /* setup resp */
-      for(j=0; j<nd_fft/2; j++)
-      {
-        resp_real[j] = pixon_function(j, 0, psize) - pixon_function(j, 0, psize_up);
-      }
-      for(j=nd_fft-1; j>=nd_fft/2; j--)
-      {
-        resp_real[j] = pixon_function(j, nd_fft, psize) - pixon_function(j, nd_fft, psize_up);
-      }
-      fftw_execute(presp);
-      
-      DataFFT::convolve_simple(conv_tmp);
-      for(j=0; j<nd; j++)
-      {
-        if(pixon_map[j] == ip)
-          conv[j] = conv_tmp[j];
-      }
+      spectrum_mul(data_fft, kernels + batch_ipixon[k]*nd_fft_cal, fft_norm, batch_fft + k*nd_fft_cal, nd_fft_cal);
+    }
+    fft_execute_dft_c2r(pback_batch[nbatch], batch_fft, batch_real);
+  }
+
+  /* pick up the output of each pixel, or convolve directly */
+  for(j=0; j<nd; j=j1)
+  {
+    ip = pixon_map[j];
+    for(j1=j+1; j1<nd && pixon_map[j1] == ip; j1++);
+
+    if(batch_slot[ip] >= 0)
+    {
+      copy_fft_out(conv+j, batch_real + batch_slot[ip]*nd_fft + j, j1-j);
+    }
+    else 
+    {
+      convolve_taps(pad_real, tap_hw_max, taps_all + ip*(2*tap_hw_max+1) + tap_hw_max, hw[ip], j, j1, conv);
     }
   }
 }
 
+void PixonFFT::convolve(const double *pseudo_img, int *pixon_map, double *conv)
+{
+  int nbatch;
+
+  update_kernel_cache();
+  nbatch = set_batch();
+  transform_image(pseudo_img, nbatch);
+  convolve_batch(kernel_fft, taps, tap_hw, pixon_map, nbatch, conv);
+}
+
+/* 
+ * convolutions with the kernel differences to the lower and upper pixon sizes, 
+ * both share one forward FFT of the image. either output can be NULL.
+ */
+void PixonFFT::convolve_pixon_diff(const double *pseudo_img, int *pixon_map, double *conv_low, double *conv_up)
+{
+  int nbatch;
+
+  update_kernel_cache();
+  nbatch = set_batch();
+  transform_image(pseudo_img, nbatch);
+  if(conv_low != NULL)
+    convolve_batch(kernel_fft_low, taps_low, tap_hw, pixon_map, nbatch, conv_low);
+  if(conv_up != NULL)
+    convolve_batch(kernel_fft_up, taps_up, tap_hw_up, pixon_map, nbatch, conv_up);
+}
+
+/* 
+ * convolution at the pixels in list only, directly with the taps, conv[k] is the output 
+ * at pixel list[k]. used to update the image after the pixon sizes of these pixels changed.
+ */
+void PixonFFT::convolve_update(const double *pseudo_img, const int *pixon_map, const int *list, int nlist, 
+                               double *conv)
+{
+  int k, j, ip, m, hw;
+  double sum;
+  const double *t;
+
+  memcpy(pad_real + tap_hw_max, pseudo_img, nd*sizeof(double));
+  for(k=0; k<nlist; k++)
+  {
+    j = list[k];
+    ip = pixon_map[j];
+    t = taps + ip*(2*tap_hw_max+1) + tap_hw_max;
+    hw = tap_hw[ip];
+    /* the single output of convolve_taps at pixel j, in the same order */
+    sum = 0.0;
+    for(m=-hw; m<=hw; m++)
+    {
+      sum += t[m] * pad_real[tap_hw_max + j - m];
+    }
+    conv[k] = sum;
+  }
+}
+
+/* 
+ * whether convolve_update over nlist pixels is cheaper than the convolution of all pixels,
+ * from operation counts as RMFFT::use_update.
+ */
+bool PixonFFT::use_update(int nlist)
+{
+  return nlist * (2*tap_hw_max+1) < 2.0 * ops_fft;
+}
+
+/* transpose of the pixon convolution, 
+ * conv[i] = sum_j img[j] * K(j, i, psize[j]), 
+ * kernels are not normalized, consistent with the chi square gradient.
+ * the masked images of all sizes in the batch are transformed in one batch and 
+ * their spectrum products are accumulated, so only one backward FFT is needed;
+ * the other sizes are scattered directly with the taps.
+ */
+void PixonFFT::convolve_transpose(const double *img, int *pixon_map, double *conv)
+{
+  int k, i, j, j1, ip, nbatch;
+
+  update_kernel_cache();
+  nbatch = set_batch();
+
+  /* direct part */
+  for(i=0; i<nd + 2*tap_hw_max; i++)
+  {
+    pad_real[i] = 0.0;
+  }
+  for(j=0; j<nd; j=j1)
+  {
+    ip = pixon_map[j];
+    for(j1=j+1; j1<nd && pixon_map[j1] == ip; j1++);
+
+    if(batch_slot[ip] < 0)
+    {
+      convolve_taps_transpose(img, taps + ip*(2*tap_hw_max+1) + tap_hw_max, tap_hw[ip], tap_norm[ip], 
+                              j, j1, pad_real, tap_hw_max);
+    }
+  }
+  memcpy(conv, pad_real + tap_hw_max, nd*sizeof(double));
+
+  /* restore the zero padding used by the direct convolution */
+  for(i=0; i<tap_hw_max; i++)
+  {
+    pad_real[i] = pad_real[nd + tap_hw_max + i] = 0.0;
+  }
+
+  if(nbatch == 0)
+    return;
+
+  /* images masked with the pixels of each pixon size */
+  for(k=0; k<nbatch; k++)
+  {
+    for(j=0; j<nd_fft; j++)
+    {
+      batch_real[k*nd_fft + j] = 0.0;
+    }
+  }
+  for(j=0; j<nd; j++)
+  {
+    if(batch_slot[pixon_map[j]] >= 0)
+      batch_real[batch_slot[pixon_map[j]]*nd_fft + j] = img[j];
+  }
+  fft_execute_dft_r2c(pdata_batch[nbatch], batch_real, batch_fft);
+
+  /* accumulate spectrum products */
+  for(k=0; k<nbatch; k++)
+  {
+    batch_spec_in[k] = batch_fft + k*nd_fft_cal;
+    batch_spec_kernel[k] = kernel_fft + batch_ipixon[k]*nd_fft_cal;
+    batch_scale[k] = kernel_norm[batch_ipixon[k]] * fft_norm;
+  }
+  spectrum_mul_sum(batch_spec_in, batch_spec_kernel, batch_scale, nbatch, conv_fft, nd_fft_cal);
+  fft_execute_dft_c2r(pbackward, conv_fft, conv_real);
+
+  for(i=0; i<nd; i++)
+  {
+    conv[i] += conv_real[i];
+  }
+}
+
 /* reduce the minimum pixon size */
 void PixonFFT::reduce_pixon_min()
 {
@@ -848,8 +1988,7 @@ void PixonFFT::reduce_pixon_min()
   }
   else 
   {
-    cout<<"reach minimumly allowed pixon sizes!"<<endl;
-    exit(0);
+    pixon_fatal("reach minimumly allowed pixon sizes!");
   }
 }
 
@@ -862,8 +2001,7 @@ void PixonFFT::increase_pixon_min()
   }
   else 
   {
-    cout<<"reach maximumly allowed pixon sizes!"<<endl;
-    exit(0);
+    pixon_fatal("reach maximumly allowed pixon sizes!");
   }
 }
 
@@ -876,11 +2014,20 @@ int PixonFFT::get_ipxion_min()
 /* class PixonUniFFT */
 PixonUniFFT::PixonUniFFT()
 {
+  ctx = NULL;
+  conv_mode = PIXON_CONV_AUTO;
   npixon_size_max = ipixon_min = 0;
   pixon_sizes = NULL;
+  kernel_ipixon_min = 0;
+  kernel_fft = NULL;
+  kernel_norm = NULL;
+  tap_hw_max = 0;
+  tap_hw = NULL;
+  taps = tap_norm = pad_real = NULL;
 }
-PixonUniFFT::PixonUniFFT(int npixel_in, int npixon_size_max_in)
-      :DataFFT(npixel_in, 1.0, npixon_size_max_in*pixon_size_factor), npixon_size_max(npixon_size_max_in)
+PixonUniFFT::PixonUniFFT(const PixonContext& ctx_in, int npixel_in, int npixon_size_max_in)
+      :DataFFT(npixel_in, 1.0, npixon_size_max_in*ctx_in.pixon_size_factor), 
+       ctx(&ctx_in), conv_mode(ctx_in.conv_mode), npixon_size_max(npixon_size_max_in)
 {
   int i;
 
@@ -888,8 +2035,27 @@ PixonUniFFT::PixonUniFFT(int npixel_in, int npixon_size_max_in)
   pixon_sizes = new double[npixon_size_max];
   for(i=0; i<npixon_size_max; i++)
   {
-    pixon_sizes[i] = (i+1)*1.0/pixon_sub_factor;
+    pixon_sizes[i] = (i+1)*1.0/ctx->pixon_sub_factor;
+  }
+
+  /* kernel cache, filled on demand */
+  kernel_ipixon_min = npixon_size_max;
+  kernel_fft = (fft_complex *) fft_malloc(npixon_size_max * nd_fft_cal * sizeof(fft_complex));
+  kernel_norm = new double[npixon_size_max];
+
+  /* kernel taps for direct convolution, not normalized */
+  tap_hw = new int[npixon_size_max];
+  tap_norm = new double[npixon_size_max];
+  tap_hw_max = (int)(ctx->pixon_size_factor * pixon_sizes[npixon_size_max-1]);
+  taps = new double[npixon_size_max * (2*tap_hw_max+1)];
+  set_pixon_taps(*ctx, npixon_size_max, tap_hw_max, taps, tap_hw, tap_norm);
+  pad_real = new double[nd + 2*tap_hw_max];
+  for(i=0; i<nd + 2*tap_hw_max; i++)
+  {
+    pad_real[i] = 0.0;
   }
+
+  calibrate_cost();
 }
 
 PixonUniFFT::~PixonUniFFT()
@@ -898,38 +2064,100 @@ PixonUniFFT::~PixonUniFFT()
   {
     npixon_size_max = 0;
     delete[] pixon_sizes;
+    fft_free(kernel_fft);
+    delete[] kernel_norm;
+
+    delete[] tap_hw;
+    delete[] tap_norm;
+    delete[] taps;
+    delete[] pad_real;
   }
 }
 
-void PixonUniFFT::convolve(const double *pseudo_img, int ipixon, double *conv)
+/* compute the spectra of pixon kernels down to ipixon that are not yet in the cache */
+void PixonUniFFT::update_kernel_cache(int ipixon)
 {
-  int ip, j;
-  double psize, norm;
+  int ip;
+  double norm;
 
-  /* fft of pseudo image */
-  memcpy(data_real, pseudo_img, nd*sizeof(double));
-  fftw_execute(pdata);
-
-  psize = pixon_sizes[ipixon];
-  /* setup resp */
-  norm = 0.0;
-  for(j=0; j<nd_fft/2; j++)
+  for(ip=kernel_ipixon_min-1; ip>=ipixon; ip--)
   {
-    resp_real[j] = pixon_function(j, 0, psize);
-    norm += resp_real[j];
+    norm = set_pixon_kernel(ctx->pixon_table, resp_real, nd_fft, ip);
+    fft_execute_dft_r2c(pforward, resp_real, resp_fft);
+
+    spectrum_scale(resp_fft, 1.0/norm, kernel_fft + ip*nd_fft_cal, nd_fft_cal);
+    kernel_norm[ip] = norm;
+    kernel_ipixon_min = ip;
   }
-  for(j=nd_fft-1; j>=nd_fft/2; j--)
+}
+
+/* whether pixon size ip is convolved directly, direct taps against a pair of transforms */
+bool PixonUniFFT::use_direct(int ip)
+{
+  if(conv_mode == PIXON_CONV_FFT)
+    return false;
+  if(conv_mode == PIXON_CONV_DIRECT)
+    return true;
+
+  return nd * (2*tap_hw[ip]+1) * cost_tap < 2.0 * cost_fft;
+}
+
+void PixonUniFFT::convolve(const double *pseudo_img, int ipixon, double *conv)
+{
+  int j;
+
+  if(use_direct(ipixon))
   {
-    resp_real[j] = pixon_function(j, nd_fft, psize);
-    norm += resp_real[j];
+    memcpy(pad_real + tap_hw_max, pseudo_img, nd*sizeof(double));
+    convolve_taps(pad_real, tap_hw_max, taps + ipixon*(2*tap_hw_max+1) + tap_hw_max, tap_hw[ipixon], 0, nd, conv);
+    for(j=0; j<nd; j++)
+    {
+      conv[j] /= tap_norm[ipixon];
+    }
+    return;
   }
-  fftw_execute(presp);
-  
-  DataFFT::convolve_simple(conv);
-  for(j=0; j<nd; j++)
+
+  update_kernel_cache(ipixon);
+
+  /* fft of pseudo image */
+  copy_fft_in(data_real, pseudo_img, nd);
+  fft_execute_dft_r2c(pforward, data_real, data_fft);
+
+  DataFFT::convolve_simple(kernel_fft + ipixon*nd_fft_cal, conv);
+}
+
+/* transpose of the uniform pixon convolution, 
+ * kernels are not normalized, consistent with the chi square gradient.
+ */
+void PixonUniFFT::convolve_transpose(const double *img, int ipixon, double *conv)
+{
+  int j;
+
+  if(use_direct(ipixon))
   {
-    conv[j] = conv[j] / norm;
+    for(j=0; j<nd + 2*tap_hw_max; j++)
+    {
+      pad_real[j] = 0.0;
+    }
+    convolve_taps_transpose(img, taps + ipixon*(2*tap_hw_max+1) + tap_hw_max, tap_hw[ipixon], 1.0, 
+                            0, nd, pad_real, tap_hw_max);
+    memcpy(conv, pad_real + tap_hw_max, nd*sizeof(double));
+
+    /* restore the zero padding */
+    for(j=0; j<tap_hw_max; j++)
+    {
+      pad_real[j] = pad_real[nd + tap_hw_max + j] = 0.0;
+    }
+    return;
   }
+
+  update_kernel_cache(ipixon);
+
+  /* fft of image */
+  copy_fft_in(data_real, img, nd);
+  fft_execute_dft_r2c(pforward, data_real, data_fft);
+
+  DataFFT::convolve_simple(kernel_fft + ipixon*nd_fft_cal, conv, 0.0, kernel_norm[ipixon]);
 }
 
 /* reduce the minimum pixon size */
@@ -941,8 +2169,7 @@ void PixonUniFFT::reduce_pixon_min()
   }
   else 
   {
-    cout<<"reach minimumly allowed pixon sizes!"<<endl;
-    exit(0);
+    pixon_fatal("reach minimumly allowed pixon sizes!");
   }
 }
 
@@ -955,8 +2182,7 @@ void PixonUniFFT::increase_pixon_min()
   }
   else 
   {
-    cout<<"reach maximumly allowed pixon sizes!"<<endl;
-    exit(0);
+    pixon_fatal("reach maximumly allowed pixon sizes!");
   }
 }
 
@@ -964,11 +2190,99 @@ int PixonUniFFT::get_ipxion_min()
 {
   return ipixon_min;
 }
+/*==================================================================*/
+/* class Arena */
+Arena::Arena()
+{
+  block = base = NULL;
+  nbytes = 0;
+}
+
+Arena::~Arena()
+{
+  if(block != NULL)
+  {
+    delete[] block;
+  }
+}
+
+void Arena::allocate()
+{
+  size_t i, offset;
+
+  if(block != NULL)
+  {
+    cout<<"arena is already allocated!"<<endl;
+    exit(0);
+  }
+
+  nbytes = 0;
+  for(i=0; i<slices.size(); i++)
+  {
+    nbytes += slices[i].nbytes;
+  }
+  block = new char[nbytes + ARENA_ALIGN];
+  base = block + (ARENA_ALIGN - (size_t)block % ARENA_ALIGN) % ARENA_ALIGN;
+  memset(base, 0, nbytes);
+
+  offset = 0;
+  for(i=0; i<slices.size(); i++)
+  {
+    *slices[i].ptr = base + offset;
+    offset += slices[i].nbytes;
+  }
+  slices.clear();
+}
+
+/*==================================================================*/
+/* class GradThreads */
+GradThreads::GradThreads()
+{
+  nthread = 0;
+  rmfft = NULL;
+  buf1 = buf2 = NULL;
+}
+
+GradThreads::~GradThreads()
+{
+  int t;
+  for(t=1; t<nthread; t++)
+  {
+    delete rmfft[t];
+  }
+}
+
+void GradThreads::setup(RMFFT *rm, double *buf1_in, double *buf2_in, int n, int nthread_in)
+{
+  int t, nstride;
+  double *work;
+
+  nthread = nthread_in;
+  /* scratch arrays of each thread start on their own cache lines */
+  nstride = (n*sizeof(double) + ARENA_ALIGN-1)/ARENA_ALIGN*ARENA_ALIGN/sizeof(double);
+  arena.add(&rmfft, nthread);
+  arena.add(&buf1, nthread);
+  arena.add(&buf2, nthread);
+  arena.add(&work, 2*(nthread-1)*nstride);
+  arena.allocate();
+
+  rmfft[0] = rm;
+  buf1[0] = buf1_in;
+  buf2[0] = buf2_in;
+  for(t=1; t<nthread; t++)
+  {
+    rmfft[t] = new RMFFT(*rm);
+    buf1[t] = work + (2*t-2)*nstride;
+    buf2[t] = work + (2*t-1)*nstride;
+  }
+}
+
 /*==================================================================*/
 /* class Pixon */
 
 Pixon::Pixon()
 {
+  ctx = NULL;
   npixel = 0;
   bg = 0.0;
   pixon_map = NULL; 
@@ -984,148 +2298,300 @@ Pixon::Pixon()
   grad_mem_pixon_low = NULL;
   resp_pixon = NULL;
   conv_pixon = NULL;
-}
-
-Pixon::Pixon(Data& cont_in, Data& line_in, int npixel_in,  int npixon_size_in, int ipositive_in, double sensitivity_in)
+  conv_pixon_low = conv_pixon_up = NULL;
+  resid_weight = NULL;
+  resid_cont = NULL;
+  grad_image = NULL;
+  resid_corr = NULL;
+  hv_image = hv_line = hv_resid = NULL;
+  reference = false;
+  x_eval = NULL;
+  nx_eval = 0;
+  eval_valid = false;
+  x_rm = NULL;
+  nx_rm = nmap_updated = 0;
+  rm_valid = false;
+  map_updated_list = NULL;
+  dimage_updated = NULL;
+  pixon_norms = NULL;
+  pixon_number = 0.0;
+}
+
+Pixon::Pixon(const PixonContext& ctx_in, Data& cont_in, Data& line_in, int npixel_in,  int npixon_size_in, int ipositive_in, 
+             double sensitivity_in, bool adjoint_grad_in)
   :cont(cont_in), line(line_in), rmfft(cont_in, fmax(npixel_in-ipositive_in, ipositive_in)), 
-   pfft(npixel_in, npixon_size_in), npixel(npixel_in),
-   bg(0.0), ipositive(ipositive_in), sensitivity(sensitivity_in)
-{
-  pixon_map = new int[npixel];
-  pixon_map_updated = new bool[npixel];
-  image = new double[npixel];
-  pseudo_image = new double[npixel];
-  rmline = new double[cont.size];
-  itline = new double[line.size];
-  residual = new double[line.size];
-  grad_pixon_low = new double[npixel];
-  grad_pixon_up = new double[npixel];
-  grad_chisq = new double[npixel+1];
-  grad_mem = new double[npixel+1];
-  grad_mem_pixon_low = new double[npixel];
-  grad_mem_pixon_up = new double[npixel];
-  resp_pixon = new double[cont.size];
-  conv_pixon = new double[cont.size];
+   pfft(ctx_in, npixel_in, npixon_size_in), ctx(&ctx_in), npixel(npixel_in),
+   bg(0.0), ipositive(ipositive_in), sensitivity(sensitivity_in), adjoint_grad(adjoint_grad_in)
+{
+  /* all buffers in one arena */
+  arena.add(&pixon_map, npixel);
+  arena.add(&pixon_map_updated, npixel);
+  arena.add(&image, npixel);
+  arena.add(&pseudo_image, npixel);
+  arena.add(&rmline, cont.size);
+  arena.add(&itline, line.size);
+  arena.add(&residual, line.size);
+  arena.add(&grad_pixon_low, npixel);
+  arena.add(&grad_pixon_up, npixel);
+  arena.add(&grad_chisq, npixel+1);
+  arena.add(&grad_mem, npixel+1);
+  arena.add(&grad_mem_pixon_low, npixel);
+  arena.add(&grad_mem_pixon_up, npixel);
+  arena.add(&resp_pixon, cont.size);
+  arena.add(&conv_pixon, cont.size);
+  arena.add(&conv_pixon_low, npixel);
+  arena.add(&conv_pixon_up, npixel);
+  arena.add(&resid_weight, line.size);
+  arena.add(&resid_cont, cont.size);
+  arena.add(&grad_image, npixel);
+  arena.add(&resid_corr, npixel);
+  arena.add(&hv_image, npixel);
+  arena.add(&hv_line, cont.size);
+  arena.add(&hv_resid, line.size);
+  arena.add(&map_updated_list, npixel);
+  arena.add(&dimage_updated, npixel);
+  arena.add(&pixon_norms, npixon_size_in);
+  arena.allocate();
+
+  reference = false;
+  x_eval = NULL;
+  nx_eval = 0;
+  eval_valid = false;
+  x_rm = NULL;
+  nx_rm = npixel+1;
+  nmap_updated = 0;
+  rm_valid = false;
+  Itot = mem_alpha = 0.0;
 
   dt = cont.time[1]-cont.time[0];  /* time interval width of continuum light curve */
   int i;
   for(i=0; i<npixel; i++)
   {
     pixon_map[i] = npixon_size_in-1;  /* set the largest pixon size */
+    pixon_map_updated[i] = false;
+  }
+
+  /* pixon_norm of each size, the basis is fixed once pixons are set up */
+  for(i=0; i<npixon_size_in; i++)
+  {
+    pixon_norms[i] = ctx->pixon_table.norm[i];
   }
+  pixon_number = npixel * pixon_norms[npixon_size_in-1];
 
   tau0 = 0.0 - ipositive * dt;
+
+  /* interpolation operators onto line epochs, the grid and epochs are fixed */
+  double *tau = new double[npixel];
+  for(i=0; i<npixel; i++)
+  {
+    tau[i] = tau0 + i * dt;
+  }
+  interp_line_op.set(cont.time, cont.size, dt, line.time, line.size);
+  interp_lag_op.set_lag(cont.time, cont.size, dt, line.time, line.size, tau, npixel);
+  delete[] tau;
 }
 
 Pixon::~Pixon()
 {
-  if(npixel > 0)
+  /* buffers are freed with the arena */
+  npixel = 0;
+  if(nx_eval > 0)
+  {
+    delete[] x_eval;
+    nx_eval = 0;
+  }
+  if(x_rm != NULL)
   {
-    npixel = 0;
-    delete[] pixon_map;
-    delete[] pixon_map_updated;
-    delete[] image;
-    delete[] pseudo_image;
-    delete[] rmline;
-    delete[] itline;
-    delete[] residual;
-    delete[] grad_chisq;
-    delete[] grad_pixon_low;
-    delete[] grad_pixon_up;
-    delete[] grad_mem;
-    delete[] grad_mem_pixon_low;
-    delete[] grad_mem_pixon_up;
-    delete[] resp_pixon;
-    delete[] conv_pixon;
+    delete[] x_rm;
+    x_rm = NULL;
   }
 }
 
-/* interpolate image, note the negative time lags */
-double Pixon::interp_image(double t)
+/* 
+ * switch to the reference evaluation with direct convolutions in double, or back to 
+ * the convolution mode of the context. the caches are keyed by the mode.
+ */
+void Pixon::set_reference(bool ref)
 {
-  int it;
-  it = (t - tau0)/dt;
-
-  if(it < 0 || it >= npixel -1)
-    return 0.0;
-
-  return image[it] + (image[it+1] - image[it])/dt * (t - (it-ipositive)*dt);
+  reference = ref;
+  rmfft.reference = ref;
+  pfft.conv_mode = ref?PIXON_CONV_DIRECT:ctx->conv_mode;
 }
 
-/* linear line interplolation  */
-double Pixon::interp_line(double t)
+/* transpose of the linear interpolation to line epochs,
+ * scatter weights w at line epochs onto continuum grid 
+ */
+void Pixon::scatter_line(const double *w, double *g)
 {
-  int it;
-
-  it = (t - cont.time[0])/dt;
-
-  if(it < 0)
-    return rmline[0];
-  else if(it >= cont.size -1)
-    return rmline[cont.size -1];
-
-  return rmline[it] + (rmline[it+1] - rmline[it])/dt * (t - cont.time[it]);
+  interp_line_op.scatter(w, g);
 }
 
-/* linear cont interplolation  */
-double Pixon::interp_cont(double t)
+/* compute rm amd pixon convolutions */
+void Pixon::compute_rm_pixon(const double *x)
 {
-  int it;
+  int i;
+  if(!update_rm_pixon(x))
+  {
+    /* convolve with pixons */
+    for(i=0; i<npixel; i++)
+    {
+      pseudo_image[i] = exp(x[i]);
+    }
+    pfft.convolve(pseudo_image, pixon_map, image);
+    bg = x[npixel];
+    
+    /* enforce positive image */
+    for(i=0; i<npixel; i++)
+    {
+      if(image[i] <= 0.0)
+        image[i] = EPS;
+    }
+    
+    /* reverberation mapping */
+    rmfft.convolve_bg(image, npixel, ipositive, rmline, bg);
+    rm_store(x);
+  }
 
-  it = (t - cont.time[0])/dt;
+  /* interpolation */
+  interp_line_op.gather(rmline, itline);
+  for(i=0; i<line.size; i++)
+  {
+    residual[i] = itline[i] - line.flux[i];
+  }
 
-  if(it < 0)
-    return cont.flux[0];
-  else if(it >= cont.size -1)
-    return cont.flux[cont.size-1];
+  /* total flux and entropy weight, shared by entropy and its gradients */
+  Itot = 0.0;
+  for(i=0; i<npixel; i++)
+  {
+    Itot += image[i];
+  }
+  mem_alpha = log(compute_pixon_number())/log(npixel);
 
-  return cont.flux[it] + (cont.flux[it+1] - cont.flux[it])/dt * (t - cont.time[it]);
+  eval_valid = false;
 }
 
-double Pixon::interp_pixon(double t)
-{
-  int it;
+/* 
+ * update image and rmline at x incrementally after the pixon sizes of a few pixels changed.
+ * each pixel picks the convolution with its own pixon size, so only the image at the changed 
+ * pixels is recomputed, directly with the taps, and rmline follows through the linear RM 
+ * operator, directly when cheaper than the transforms.
+ * return false if image and rmline were not computed at x, or the update costs more than 
+ * the pixon convolution.
+ */
+bool Pixon::update_rm_pixon(const double *x)
+{
+  int i, k;
+  double img;
+
+  if(!rm_valid || rm_reference != reference || rm_conv_mode != pfft.conv_mode)
+    return false;
+  if(memcmp(x, x_rm, nx_rm*sizeof(double)) != 0)
+    return false;
+  if(nmap_updated == 0)
+    return true;
+  if(!pfft.use_update(nmap_updated))
+    return false;
+
+  pfft.convolve_update(pseudo_image, pixon_map, map_updated_list, nmap_updated, dimage_updated);
+  for(k=0; k<nmap_updated; k++)
+  {
+    i = map_updated_list[k];
+    img = (dimage_updated[k] <= 0.0)?EPS:dimage_updated[k];
+    dimage_updated[k] = img - image[i];
+    image[i] = img;
+    pixon_map_updated[i] = false;
+  }
 
-  it = (t - cont.time[0])/dt;
+  if(reference || rmfft.use_update(nmap_updated))
+    rmfft.convolve_update(map_updated_list, dimage_updated, nmap_updated, ipositive, rmline);
+  else 
+    rmfft.convolve_bg(image, npixel, ipositive, rmline, bg);
+  nmap_updated = 0;
+  return true;
+}
 
-  if(it < 0)
-    return conv_pixon[0];
-  else if(it >= cont.size -1)
-    return conv_pixon[cont.size-1];
+/* record that image and rmline are those of x with the current pixon map */
+void Pixon::rm_store(const double *x)
+{
+  int k;
+  if(x_rm == NULL)
+  {
+    x_rm = new double[nx_rm];
+  }
+  memcpy(x_rm, x, nx_rm*sizeof(double));
+  rm_reference = reference;
+  rm_conv_mode = pfft.conv_mode;
+  rm_valid = true;
 
-  return conv_pixon[it] + (conv_pixon[it+1] - conv_pixon[it])/dt * (t - cont.time[it]);
+  for(k=0; k<nmap_updated; k++)
+  {
+    pixon_map_updated[map_updated_list[k]] = false;
+  }
+  nmap_updated = 0;
 }
 
-/* compute rm amd pixon convolutions */
-void Pixon::compute_rm_pixon(const double *x)
+/* 
+ * flag a pixel whose pixon size changed, for the incremental update of image and rmline.
+ */
+void Pixon::flag_pixon_map_updated(int ip)
 {
-  int i;
-  double t;
-  /* convolve with pixons */
-  for(i=0; i<npixel; i++)
+  if(!pixon_map_updated[ip])
   {
-    pseudo_image[i] = exp(x[i]);
+    pixon_map_updated[ip] = true;
+    map_updated_list[nmap_updated++] = ip;
   }
-  pfft.convolve(pseudo_image, pixon_map, image);
-  bg = x[npixel];
-  
-  /* enforce positive image */
-  for(i=0; i<npixel; i++)
+}
+
+/* 
+ * whether the last evaluation was at x, with the gradient if it is wanted.
+ * the cache is also keyed by the convolution modes, so reference evaluations are not mixed in.
+ */
+bool Pixon::eval_cached(const double *x, int n, bool want_grad)
+{
+  if(!eval_valid || n != nx_eval || (want_grad && !eval_grad))
+    return false;
+  if(eval_reference != reference || eval_conv_mode != pfft.conv_mode)
+    return false;
+  return memcmp(x, x_eval, n*sizeof(double)) == 0;
+}
+
+/* record the evaluation at x with objective f */
+void Pixon::eval_store(const double *x, int n, bool want_grad, double f)
+{
+  if(n != nx_eval)
   {
-    if(image[i] <= 0.0)
-      image[i] = EPS;
+    if(nx_eval > 0)
+      delete[] x_eval;
+    x_eval = new double[n];
+    nx_eval = n;
   }
-  
-  /* reverberation mapping */
-  rmfft.convolve_bg(image, npixel, ipositive, rmline, bg);
+  memcpy(x_eval, x, n*sizeof(double));
+  eval_grad = want_grad;
+  eval_reference = reference;
+  eval_conv_mode = pfft.conv_mode;
+  f_eval = f;
+  eval_valid = true;
+}
 
-  /* interpolation */
-  for(i=0; i<line.size; i++)
+/* 
+ * evaluate the objective chisq + mem at x, and its gradient in grad_chisq and grad_mem 
+ * if wanted. a repeated evaluation at the last x returns at once.
+ */
+double Pixon::evaluate(const double *x, bool want_grad)
+{
+  double f;
+  if(eval_cached(x, npixel+1, want_grad))
+    return f_eval;
+
+  compute_rm_pixon(x);
+  f = compute_chisquare(x) + compute_mem(x);
+  if(want_grad)
   {
-    t = line.time[i];
-    itline[i] = interp_line(t);
-    residual[i] = itline[i] - line.flux[i];
+    compute_chisquare_grad(x);
+    compute_mem_grad(x);
   }
+  eval_store(x, npixel+1, want_grad, f);
+  return f;
 }
 
 /* compute chi square */
@@ -1145,51 +2611,67 @@ double Pixon::compute_chisquare(const double *x)
 /* compute entropy */
 double Pixon::compute_mem(const double *x)
 {
-  double Itot, num, alpha;
   int i;
 
-  Itot = 0.0;
-  for(i=0; i<npixel; i++)
-  {
-    Itot += image[i];
-  }
-  
-  num = compute_pixon_number();
-  alpha = log(num)/log(npixel);
-
   mem = 0.0;
   for(i=0; i<npixel; i++)
   {
     mem += (image[i]/Itot) * log(image[i]/Itot);
   }
-  mem *= 2.0*alpha;
+  mem *= 2.0*mem_alpha;
   return mem;
 }
 
 /* compute gradient of chi square line */
 void Pixon::compute_chisquare_grad(const double *x)
 {
-  int i, k, j;
-  double psize, t, grad_in, grad_out;
-  for(i=0; i<npixel; i++)
-  {   
-    for(j=0; j<npixel; j++)
-    {
-      psize = pfft.pixon_sizes[pixon_map[j]];
-      resp_pixon[j] = pixon_function(j, i, psize);
-    }
-    rmfft.set_resp_real(resp_pixon, npixel, ipositive);
-    //rmfft.convolve(resp_pixon, npixel, conv_pixon);
-    rmfft.convolve_simple(conv_pixon);
+  if(adjoint_grad)
+    compute_chisquare_grad_adjoint(x);
+  else 
+    compute_chisquare_grad_ref(x);
+}
 
-    grad_out = 0.0;
-    for(k=0; k<line.size; k++)
-    {
-      t = line.time[k];
-      grad_in = interp_pixon(t);
-      grad_out += grad_in * residual[k]/line.error[k]/line.error[k];
+/* compute gradient of chi square line, 
+ * reference implementation with one RM convolution for each pixel
+ */
+void Pixon::compute_chisquare_grad_ref(const double *x)
+{
+  int i, k, j, t;
+  double grad_out, *resp, *conv;
+
+  /* weighted residuals */
+  for(k=0; k<line.size; k++)
+  {
+    resid_weight[k] = residual[k]/line.error[k]/line.error[k];
+  }
+
+  /* per-thread workspaces, only made once the reference gradient is used */
+  if(grad_threads.nthread == 0)
+    grad_threads.setup(&rmfft, resp_pixon, conv_pixon, cont.size, grad_nthreads);
+
+  /* pixels are independent, each thread convolves with its own workspace */
+  #pragma omp parallel num_threads(grad_threads.nthread) private(i, j, t, grad_out, resp, conv)
+  {
+    t = grad_thread_num();
+    RMFFT &rm = *grad_threads.rmfft[t];
+    resp = grad_threads.buf1[t];
+    conv = grad_threads.buf2[t];
+    if(t > 0)
+      rm.set_data(rmfft);
+
+    #pragma omp for schedule(static)
+    for(i=0; i<npixel; i++)
+    {   
+      for(j=0; j<npixel; j++)
+      {
+        resp[j] = ctx->pixon_table.value(pixon_map[j], j-i);
+      }
+      rm.set_resp_real(resp, npixel, ipositive);
+      rm.convolve_simple(conv);
+
+      interp_line_op.correlate(conv, resid_weight, &grad_out);
+      grad_chisq[i] = grad_out * 2.0 * pseudo_image[i];
     }
-    grad_chisq[i] = grad_out * 2.0 * pseudo_image[i];
   }
   
   /* with respect to background */
@@ -1201,29 +2683,82 @@ void Pixon::compute_chisquare_grad(const double *x)
   grad_chisq[npixel] = grad_out * 2.0;
 }
 
+/* compute gradient of chi square line with adjoint method,
+ * the weighted residuals are scattered onto continuum grid, 
+ * then correlated with continuum and pixon kernels.
+ */
+void Pixon::compute_chisquare_grad_adjoint(const double *x)
+{
+  int i, k;
+  double grad_out;
+
+  /* weighted residuals */
+  for(k=0; k<line.size; k++)
+  {
+    resid_weight[k] = residual[k]/line.error[k]/line.error[k];
+  }
+  scatter_line(resid_weight, resid_cont);
+
+  /* gradient with respect to image */
+  rmfft.correlate_data(resid_cont, npixel, ipositive, grad_image);
+  
+  /* gradient with respect to pseudo image */
+  pfft.convolve_transpose(grad_image, pixon_map, conv_pixon);
+  for(i=0; i<npixel; i++)
+  {
+    grad_chisq[i] = conv_pixon[i] * 2.0 * pseudo_image[i];
+  }
+
+  /* with respect to background */
+  grad_out = 0.0;
+  for(k=0; k<line.size; k++)
+  {
+    grad_out += residual[k]/line.error[k]/line.error[k];
+  }
+  grad_chisq[npixel] = grad_out * 2.0;
+}
+
+/* 
+ * calculate chisquare and entropy gradients with respect to pixon size, 
+ * towards the lower sizes, the upper sizes, or both. the kernel difference 
+ * convolutions of the pseudo image are done in one pass and shared by both gradients.
+ */
+void Pixon::compute_grad_pixon_size(bool low, bool up)
+{
+  int k;
+
+  pfft.convolve_pixon_diff(pseudo_image, pixon_map, low?conv_pixon_low:NULL, up?conv_pixon_up:NULL);
+
+  /* weighted residuals correlated with the continuum shifted by each lag */
+  for(k=0; k<line.size; k++)
+  {
+    resid_weight[k] = residual[k]/line.error[k]/line.error[k];
+  }
+  interp_lag_op.correlate(cont.flux, resid_weight, resid_corr);
+
+  if(low)
+  {
+    compute_chisquare_grad_pixon_low();
+    compute_mem_grad_pixon_low();
+  }
+  if(up)
+  {
+    compute_chisquare_grad_pixon_up();
+    compute_mem_grad_pixon_up();
+  }
+}
+
 /* calculate chisqure gradient with respect to pixon size 
  * when pixon size decreases, chisq decreases, 
  * so chisq gradient is positive 
  */
 void Pixon::compute_chisquare_grad_pixon_low()
 {
-  int i, k, j;
-  double psize, psize_low, t, grad_in, grad_out, K, grad_size, tau;
-  int jrange1, jrange2;
+  int i;
 
-  pfft.convolve_pixon_diff_low(pseudo_image, pixon_map, conv_pixon);
   for(i=0; i<npixel; i++)
   {   
-    grad_size = conv_pixon[i];
-    grad_out = 0.0;
-    tau = tau0 + i * dt;
-    for(k=0; k<line.size; k++)
-    {
-      t = line.time[k];
-      grad_in = interp_cont(t - tau);
-      grad_out += grad_in * residual[k]/line.error[k]/line.error[k];
-    }
-    grad_pixon_low[i] = grad_out * 2.0 * grad_size;
+    grad_pixon_low[i] = resid_corr[i] * 2.0 * conv_pixon_low[i];
   }
 }
 
@@ -1233,51 +2768,32 @@ void Pixon::compute_chisquare_grad_pixon_low()
  */
 void Pixon::compute_chisquare_grad_pixon_up()
 {
-  int i, k, j;
-  double psize, psize_up, t, tau, grad_in, grad_out, grad_size, K;
-  int jrange1, jrange2;
+  int i;
 
-  pfft.convolve_pixon_diff_up(pseudo_image, pixon_map, conv_pixon);
   for(i=0; i<npixel; i++)
-  {
-    grad_size = conv_pixon[i];
-    grad_out = 0.0;
-    tau = tau0 + i * dt;
-    for(k=0; k<line.size; k++)
-    {
-      t = line.time[k];
-      grad_in = interp_cont(t - tau);
-      grad_out += grad_in * residual[k]/line.error[k]/line.error[k];
-    }
-    grad_pixon_up[i] = grad_out * 2.0 * grad_size;
+  {   
+    grad_pixon_up[i] = resid_corr[i] * 2.0 * conv_pixon_up[i];
   }
 }
 
 /* calculate entropy gradient
- *
+ * grad_in[i] = sum_j (1 + log(image[j]/Itot)) * K(j, i, psize[j]) 
  */
 void Pixon::compute_mem_grad(const double *x)
 {
-  double Itot, num, alpha, grad_in, psize, K;
-  int i, j;
-  Itot = 0.0;
+  int i;
+  
+  /* gradient with respect to image */
   for(i=0; i<npixel; i++)
   {
-    Itot += image[i];
+    resp_pixon[i] = 1.0 + log(image[i]/Itot);
   }
-  num = compute_pixon_number();
-  alpha = log(num)/log(npixel);
-  
+
+  /* gradient with respect to pseudo image, by the transpose of the pixon convolution */
+  pfft.convolve_transpose(resp_pixon, pixon_map, conv_pixon);
   for(i=0; i<npixel; i++)
   {       
-    grad_in = 0.0;
-    for(j=0; j<npixel; j++)
-    {
-      psize = pfft.pixon_sizes[pixon_map[j]];
-      K = pixon_function(j, i, psize);
-      grad_in += (1.0 + log(image[j]/Itot)) * K;
-    }
-    grad_mem[i] = 2.0 * alpha * pseudo_image[i] * grad_in / Itot;
+    grad_mem[i] = 2.0 * mem_alpha * pseudo_image[i] * conv_pixon[i] / Itot;
   }
   /* with respect to bg is zero */
   grad_mem[npixel] = 0.0;
@@ -1288,22 +2804,14 @@ void Pixon::compute_mem_grad(const double *x)
  */
 void Pixon::compute_mem_grad_pixon_low()
 {
-  double Itot, num, alpha, grad_in, psize, psize_low, K;
-  int i, j, jrange1, jrange2, grad_size;
-  Itot = 0.0;
-  for(i=0; i<npixel; i++)
-  {
-    Itot += image[i];
-  }
-  num = compute_pixon_number();
-  alpha = log(num)/log(npixel);
+  double grad_in;
+  int i, grad_size;
 
-  pfft.convolve_pixon_diff_low(pseudo_image, pixon_map, conv_pixon);
   for(i=0; i<npixel; i++)
   {       
-    grad_size = conv_pixon[i];
+    grad_size = conv_pixon_low[i];
     grad_in = (1.0 + log(image[i]/Itot));
-    grad_mem_pixon_low[i] = 2.0* alpha * grad_in * grad_size / Itot;
+    grad_mem_pixon_low[i] = 2.0* mem_alpha * grad_in * grad_size / Itot;
   }
 }
 
@@ -1312,37 +2820,106 @@ void Pixon::compute_mem_grad_pixon_low()
  */
 void Pixon::compute_mem_grad_pixon_up()
 {
-  double Itot, num, alpha, grad_in, psize, psize_up, K;
-  int i, j, jrange1, jrange2, grad_size;
-  Itot = 0.0;
-  for(i=0; i<npixel; i++)
-  {
-    Itot += image[i];
-  }
-  num = compute_pixon_number();
-  alpha = log(num)/log(npixel);
+  double grad_in;
+  int i, grad_size;
 
-  pfft.convolve_pixon_diff_up(pseudo_image, pixon_map, conv_pixon);
   for(i=0; i<npixel; i++)
   {       
-    grad_size = conv_pixon[i];
+    grad_size = conv_pixon_up[i];
     grad_in = (1.0 + log(image[i]/Itot));
-    grad_mem_pixon_up[i] = 2.0* alpha * grad_in * grad_size / Itot;
+    grad_mem_pixon_up[i] = 2.0* mem_alpha * grad_in * grad_size / Itot;
   }
 }
 
-double Pixon::compute_pixon_number()
+/* 
+ * product of the hessian of chisq + mem at x with v, which is the derivative of 
+ * the gradient along v. it takes one forward pass of the pixon and RM convolutions 
+ * for the perturbed image and one adjoint pass back to the pseudo image.
+ */
+void Pixon::compute_hessian_vector(const double *x, const double *v, double *hv)
+{
+  evaluate(x, true);
+
+  perturb_image(v);
+  rmfft.convolve_bg(hv_image, npixel, ipositive, hv_line, v[npixel]);
+  perturb_residual();
+  rmfft.correlate_data(hv_line, npixel, ipositive, grad_image);
+
+  compute_hessian_vector_image(v, hv);
+}
+
+/* perturbation of image along v, hv_image = K (pseudo_image * v) */
+void Pixon::perturb_image(const double *v)
 {
   int i;
-  double num, psize;
-    
-  num = 0.0;
   for(i=0; i<npixel; i++)
   {
-    psize = pfft.pixon_sizes[pixon_map[i]];
-    num += pixon_norm(psize);
+    conv_pixon[i] = pseudo_image[i] * v[i];
+  }
+  pfft.convolve(conv_pixon, pixon_map, hv_image);
+}
+
+/* 
+ * interpolate the perturbation of rmline in hv_line to line epochs, weight it,
+ * and scatter it back onto continuum grid in hv_line. the weighted residuals 
+ * at x are scattered into resid_cont, for the terms bilinear in the continuum.
+ */
+void Pixon::perturb_residual()
+{
+  int k;
+
+  interp_line_op.gather(hv_line, hv_resid);
+  for(k=0; k<line.size; k++)
+  {
+    hv_resid[k] /= line.error[k] * line.error[k];
+    resid_weight[k] = residual[k]/line.error[k]/line.error[k];
+  }
+  scatter_line(hv_resid, hv_line);
+  scatter_line(resid_weight, resid_cont);
+}
+
+/* 
+ * complete the hessian product for pseudo image and background, given the 
+ * perturbation of chisq gradient with respect to image in grad_image.
+ * with p = exp(x), I = K p and h = 1 + log(I/Itot), the entropy gradient is 
+ * 2 alpha p K^T h/Itot, which is differentiated along v as well.
+ */
+void Pixon::compute_hessian_vector_image(const double *v, double *hv)
+{
+  int i, k;
+  double dItot, hv_bg;
+
+  dItot = 0.0;
+  for(i=0; i<npixel; i++)
+  {
+    dItot += hv_image[i];
+  }
+
+  for(i=0; i<npixel; i++)
+  {
+    grad_image[i] = 2.0 * grad_image[i] 
+                  + 2.0 * mem_alpha/Itot * (hv_image[i]/image[i] - dItot/Itot);
+  }
+  pfft.convolve_transpose(grad_image, pixon_map, conv_pixon);
+  for(i=0; i<npixel; i++)
+  {
+    hv[i] = pseudo_image[i] * conv_pixon[i] + v[i] * (grad_chisq[i] + grad_mem[i]) 
+          - grad_mem[i] * dItot/Itot;
+  }
+
+  /* with respect to background */
+  hv_bg = 0.0;
+  for(k=0; k<line.size; k++)
+  {
+    hv_bg += hv_resid[k];
   }
-  return num;
+  hv[npixel] = 2.0 * hv_bg;
+}
+
+/* pixon number, maintained by the pixon map mutators */
+double Pixon::compute_pixon_number()
+{
+  return pixon_number;
 }
 
 void Pixon::reduce_pixon_map_all()
@@ -1355,6 +2932,9 @@ void Pixon::reduce_pixon_map_all()
   {
     pixon_map[i]--;
   }
+  pixon_number = npixel * pixon_norms[pfft.ipixon_min];
+  eval_valid = false;
+  rm_valid = false;
 }
 
 bool Pixon::reduce_pixon_map_uniform()
@@ -1363,7 +2943,7 @@ bool Pixon::reduce_pixon_map_uniform()
   bool flag = false;
   for(i=0; i<npixel; i++)
   {
-    if(pixon_map[i] > pixon_map_low_bound + 1)
+    if(pixon_map[i] > ctx->pixon_map_low_bound + 1)
     {
       reduce_pixon_map(i);
       flag = true;
@@ -1383,49 +2963,55 @@ void Pixon::increase_pixon_map_all()
   {
     pixon_map[i]++;
   }
+  pixon_number = npixel * pixon_norms[pfft.ipixon_min];
+  eval_valid = false;
+  rm_valid = false;
 }
 
 void Pixon::reduce_pixon_map(int ip)
 {
   pfft.pixon_sizes_num[pixon_map[ip]]--;
+  pixon_number -= pixon_norms[pixon_map[ip]];
   pixon_map[ip]--;
   pfft.pixon_sizes_num[pixon_map[ip]]++;
+  pixon_number += pixon_norms[pixon_map[ip]];
   if(pfft.ipixon_min > pixon_map[ip])
   {
     pfft.ipixon_min = pixon_map[ip];
   }
+  flag_pixon_map_updated(ip);
+  eval_valid = false;
 }
 
 void Pixon::increase_pixon_map(int ip)
 {
   pfft.pixon_sizes_num[pixon_map[ip]]--;
+  pixon_number -= pixon_norms[pixon_map[ip]];
   pixon_map[ip]++;
   pfft.pixon_sizes_num[pixon_map[ip]]++;
+  pixon_number += pixon_norms[pixon_map[ip]];
+  flag_pixon_map_updated(ip);
+  eval_valid = false;
 }
 
 bool Pixon::update_pixon_map()
 {
   int i;
-  double psize, psize_low, dnum_low, num;
+  double dnum_low, num;
   bool flag=false;
 
-  cout<<"update pixon map."<<endl;
-  compute_chisquare_grad_pixon_low();
-  compute_mem_grad_pixon_low();
+  pixon_log()<<"update pixon map."<<endl;
+  compute_grad_pixon_size(true, false);
   for(i=0; i<npixel; i++)
   {
-    pixon_map_updated[i] = false;
-    if(pixon_map[i] > pixon_map_low_bound + 1)
+    if(pixon_map[i] > ctx->pixon_map_low_bound + 1)
     {
-      psize = pfft.pixon_sizes[pixon_map[i]];
-      psize_low = pfft.pixon_sizes[pixon_map[i]-1];
-      num = pixon_norm(psize);
-      dnum_low = pixon_norm(psize_low) - num;
+      num = pixon_norms[pixon_map[i]];
+      dnum_low = pixon_norms[pixon_map[i]-1] - num;
       if( grad_pixon_low[i] + grad_mem_pixon_low[i] > dnum_low  * (1.0 + sensitivity/sqrt(2.0*num)))
       {
         reduce_pixon_map(i);
-        pixon_map_updated[i] = true;
-        cout<<"decrease "<< i <<"-th pixel to "<<pfft.pixon_sizes[pixon_map[i]]<<endl;
+        pixon_log()<<"decrease "<< i <<"-th pixel to "<<pfft.pixon_sizes[pixon_map[i]]<<endl;
         flag=true;
       }
     }
@@ -1436,24 +3022,21 @@ bool Pixon::update_pixon_map()
 bool Pixon::increase_pixon_map()
 {
   int i;
-  double psize, psize_up, dnum_up, num;
+  double dnum_up, num;
   bool flag=false;
 
-  cout<<"update pixon map."<<endl;
-  compute_chisquare_grad_pixon_up();
-  compute_mem_grad_pixon_up();
+  pixon_log()<<"update pixon map."<<endl;
+  compute_grad_pixon_size(false, true);
   for(i=0; i<npixel; i++)
   {
     if(pixon_map[i] < pfft.npixon_size_max - 1)
     {
-      psize = pfft.pixon_sizes[pixon_map[i]];
-      psize_up = pfft.pixon_sizes[pixon_map[i]+1];
-      num = pixon_norm(psize);
-      dnum_up = num - pixon_norm(psize_up);
+      num = pixon_norms[pixon_map[i]];
+      dnum_up = num - pixon_norms[pixon_map[i]+1];
       if(grad_pixon_up[i] + grad_mem_pixon_up[i] <= dnum_up )
       {
         increase_pixon_map(i);
-        cout<<"increase "<< i <<"-th pixel to "<<pfft.pixon_sizes[pixon_map[i]]<<endl;
+        pixon_log()<<"increase "<< i <<"-th pixel to "<<pfft.pixon_sizes[pixon_map[i]]<<endl;
         flag=true;
       }
     }
@@ -1461,30 +3044,21 @@ bool Pixon::increase_pixon_map()
   return flag;
 }
 /*==================================================================*/
-/* pixon functions */
-PixonFunc pixon_function;
-PixonNorm pixon_norm;
-
 /* function for nlopt */
 double func_nlopt(const vector<double> &x, vector<double> &grad, void *f_data)
 {
   Pixon *pixon = (Pixon *)f_data;
-  double chisq, mem;
+  double f;
 
-  pixon->compute_rm_pixon(x.data());
+  f = pixon->evaluate(x.data(), !grad.empty());
   if (!grad.empty()) 
   {
     int i;
     
-    pixon->compute_chisquare_grad(x.data());
-    pixon->compute_mem_grad(x.data());
-    
     for(i=0; i<(int)grad.size(); i++)
       grad[i] = pixon->grad_chisq[i] + pixon->grad_mem[i];
   }
-  chisq = pixon->compute_chisquare(x.data());
-  mem = pixon->compute_mem(x.data());
-  return chisq + mem;
+  return f;
 }
 
 /* function for tnc */
@@ -1492,19 +3066,20 @@ int func_tnc(double x[], double *f, double g[], void *state)
 {
   Pixon *pixon = (Pixon *)state;
   int i;
-  double chisq, mem;
 
-  pixon->compute_rm_pixon(x);
-  pixon->compute_chisquare_grad(x);
-  pixon->compute_mem_grad(x);
-  
-  chisq = pixon->compute_chisquare(x);
-  mem = pixon->compute_mem(x);
-
-  *f = chisq + mem;
+  *f = pixon->evaluate(x, true);
 
   for(i=0; i<pixon->npixel+1; i++)
     g[i] = pixon->grad_chisq[i] + pixon->grad_mem[i];
 
   return 0;
+}
+
+/* hessian times vector for tnc */
+int hessp_tnc(double x[], double v[], double hv[], void *state)
+{
+  Pixon *pixon = (Pixon *)state;
+
+  pixon->compute_hessian_vector(x, v, hv);
+  return 0;
 }
\ No newline at end of file
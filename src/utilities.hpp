@@ -13,24 +13,86 @@
 #include <fstream> 
 #include <vector>
 #include <iomanip>
+#include <sstream>
 #include <cstring>
 #include <cmath>
 #include <random>
 #include <nlopt.hpp>
 #include <fftw3.h>
+#ifdef _OPENMP
+#include <omp.h>
+#endif
 
 #include "tnc.h"
 #include "cfgparser.hpp"
+#include "interp.hpp"
 
 #define EPS (1.0e-50)
+/* real FFT of length n in units of direct multiply-adds, n*log2(n) times this, see calibrate_cost */
+#define FFT_COST_FACTOR (2.0)
+
+/* 
+ * precision of FFT buffers and plans, single precision with PIXON_FFT_FLOAT.
+ * interfaces stay in double, values are converted on copy-in and copy-out.
+ */
+#ifdef PIXON_FFT_FLOAT
+typedef float fft_real;
+typedef fftwf_complex fft_complex;
+typedef fftwf_plan fft_plan;
+#define fft_malloc fftwf_malloc
+#define fft_free fftwf_free
+#define fft_plan_many_dft_r2c fftwf_plan_many_dft_r2c
+#define fft_plan_many_dft_c2r fftwf_plan_many_dft_c2r
+#define fft_execute_dft_r2c fftwf_execute_dft_r2c
+#define fft_execute_dft_c2r fftwf_execute_dft_c2r
+#define fft_destroy_plan fftwf_destroy_plan
+#define fft_import_wisdom_from_filename fftwf_import_wisdom_from_filename
+#define fft_export_wisdom_to_filename fftwf_export_wisdom_to_filename
+#define fft_init_threads fftwf_init_threads
+#define fft_plan_with_nthreads fftwf_plan_with_nthreads
+#else
+typedef double fft_real;
+typedef fftw_complex fft_complex;
+typedef fftw_plan fft_plan;
+#define fft_malloc fftw_malloc
+#define fft_free fftw_free
+#define fft_plan_many_dft_r2c fftw_plan_many_dft_r2c
+#define fft_plan_many_dft_c2r fftw_plan_many_dft_c2r
+#define fft_execute_dft_r2c fftw_execute_dft_r2c
+#define fft_execute_dft_c2r fftw_execute_dft_c2r
+#define fft_destroy_plan fftw_destroy_plan
+#define fft_import_wisdom_from_filename fftw_import_wisdom_from_filename
+#define fft_export_wisdom_to_filename fftw_export_wisdom_to_filename
+#define fft_init_threads fftw_init_threads
+#define fft_plan_with_nthreads fftw_plan_with_nthreads
+#endif
 
 using namespace std;
 
 enum PRIOR_TYPE {GAUSSIAN=1, UNIFORM=2};
 
-extern int pixon_size_factor;
-extern int pixon_sub_factor;
-extern int pixon_map_low_bound;
+extern unsigned int fft_planner_flag;
+extern bool conv_cost_timed;
+extern int fft_nthreads;
+extern int fft_thread_min;
+extern int grad_nthreads;
+
+enum FFT_PLAN_KIND {FFT_R2C=0, FFT_C2R=1};
+enum PIXON_CONV {PIXON_CONV_AUTO=0, PIXON_CONV_FFT=1, PIXON_CONV_DIRECT=2};
+
+void set_fft_planner(string planner);
+void set_conv_cost(string cost);
+void set_fft_threads(int nthreads, int nmin);
+void set_grad_threads(int nthreads);
+fft_plan get_fft_plan(int n, int kind, int howmany=1, int alignment=0);
+void destroy_fft_plans();
+ostream& pixon_log();
+void set_pixon_log(ostringstream *buf);
+void flush_pixon_log();
+void pixon_fatal(string msg);
+int next_fft_size(int n);
+void import_fft_wisdom(string fname);
+void export_fft_wisdom(string fname);
 
 class Config;
 class PixonBasis;
@@ -88,35 +150,203 @@ class Config
     int max_pixon_size;
     /* snsitivity for pixon size search */
     double sensitivity;
+    /* use adjoint (correlation) formulation for chi square gradient */
+    bool adjoint_grad;
+    /* exact hessian times vector products in TNC, or finite differences of the gradient */
+    bool exact_hessp;
+
+    /* FFTW planner: estimate, measure, patient, or exhaustive */
+    string fft_planner;
+    /* file of FFTW wisdom, empty to disable */
+    string fftw_wisdom;
+    /* pixon convolution: auto, fft, or direct */
+    string pixon_conv;
+    /* cost model of the auto convolution: model or timed */
+    string conv_cost;
+    /* number of FFTW threads, and the minimum transform size that uses them */
+    int fft_threads;
+    int fft_thread_min;
+    /* number of threads of the per-pixel gradient loops */
+    int grad_threads;
+    /* number of reconstruction modes run concurrently with drv_lc_model = 3 */
+    int run_threads;
 };
 
 /* 
- *  class for pixon basis functions
+ *  class for pixon basis functions, with the constants of the basis in use,
+ *  which depend on the pixon size factor.
  */
 class PixonBasis
 {
   public:
-    static double norm_gaussian;
-    static double coeff1_modified_gaussian;
-    static double coeff2_modified_gaussian;
-    static double norm_modified_gaussian;
-    static double gaussian(double x, double y, double psize);
-    static double gaussian_norm(double psize);
-    static double modified_gaussian(double x, double y, double psize);
-    static double modified_gaussian_norm(double psize);
-    static double parabloid(double x, double y, double psize);
-    static double parabloid_norm(double psize);
-    static double tophat(double x, double y, double psize);
-    static double tophat_norm(double psize);
-    static double triangle(double x, double y, double psize);
-    static double triangle_norm(double psize);
-    static double lorentz(double x, double y, double psize);
-    static double lorentz_norm(double psize);
-    static double wendland(double x, double y, double psize);
-    static double wendland_norm(double psize);
+    PixonBasis();
+    /* constants of basis type with pixon size factor size_factor_in */
+    void set(int type_in, int size_factor_in);
+    /* pixon function at x of the pixon at y, and its normalization */
+    double function(double x, double y, double psize) const;
+    double norm(double psize) const;
+    /* k[j] = function(x0 + j, 0, psize), j=0,...,n-1, one loop over the kernel */
+    void fill(double *k, int n, double x0, double psize) const;
+
+    int type;
+    int size_factor;  /* extension of pixon in term of pixon size */
+    double norm_gaussian;
+    double coeff1_modified_gaussian;
+    double coeff2_modified_gaussian;
+    double norm_modified_gaussian;
     static string pixonbasis_name[];
 };
 
+/* 
+ * pixon basis kernels as policy types, value(d, psize, b) is the kernel at distance d 
+ * in pixels and norm(psize, b) its normalization, with the constants of basis b.
+ * loops templated on a policy inline the kernel, see PixonBasis::fill. values are 
+ * computed before the truncation is selected, so that the loops have no branches.
+ */
+struct PixonKernelGaussian
+{
+  static inline double norm(double psize, const PixonBasis &b)
+  {
+    return 1.0/(b.norm_gaussian*psize/3.0);
+  }
+  static inline double value(double d, double psize, const PixonBasis &b)
+  {
+    return (fabs(d) <= b.size_factor * psize)?norm(psize, b) * exp( -0.5*d*d/(psize/3*psize/3) ):0.0;
+  }
+};
+
+struct PixonKernelModifiedGaussian
+{
+  static inline double norm(double psize, const PixonBasis &b)
+  {
+    return 1.0/(b.norm_modified_gaussian*psize/3.0);
+  }
+  static inline double value(double d, double psize, const PixonBasis &b)
+  {
+    return (fabs(d) <= b.size_factor * psize)?
+           PixonKernelGaussian::norm(psize, b)/b.coeff2_modified_gaussian 
+           * (exp( -0.5*d*d/(psize/3*psize/3) ) - b.coeff1_modified_gaussian):0.0;
+  }
+};
+
+struct PixonKernelParabloid
+{
+  static inline double norm(double psize, const PixonBasis &b)
+  {
+    return 1.0/(psize * 4.0/3.0 * b.size_factor);
+  }
+  static inline double value(double d, double psize, const PixonBasis &b)
+  {
+    double r = fabs(d)/(b.size_factor * psize), k = norm(psize, b) * (1.0 - r*r);
+    return (r <= 1.0)?k:0.0;
+  }
+};
+
+struct PixonKernelTophat
+{
+  static inline double norm(double psize, const PixonBasis &b)
+  {
+    return 1.0/(psize * 2.0*b.size_factor);
+  }
+  static inline double value(double d, double psize, const PixonBasis &b)
+  {
+    double k = PixonKernelParabloid::norm(psize, b);
+    return (fabs(d) <= b.size_factor * psize)?k:0.0;
+  }
+};
+
+struct PixonKernelTriangle
+{
+  static inline double norm(double psize, const PixonBasis &b)
+  {
+    return 1.0/(b.size_factor * psize);
+  }
+  static inline double value(double d, double psize, const PixonBasis &b)
+  {
+    double r = fabs(d)/(b.size_factor * psize), k = norm(psize, b) * (1.0 - r);
+    return (r <= 1.0)?k:0.0;
+  }
+};
+
+struct PixonKernelLorentz
+{
+  static inline double norm(double psize, const PixonBasis &b)
+  {
+    return 1.0/(2.0*psize/3.0 * atan(b.size_factor*3.0));
+  }
+  static inline double value(double d, double psize, const PixonBasis &b)
+  {
+    double r = fabs(d)/psize, k = norm(psize, b) / (1.0 + r*r*3*3);
+    return (r <= b.size_factor)?k:0.0;
+  }
+};
+
+struct PixonKernelWendland
+{
+  static inline double norm(double psize, const PixonBasis &)
+  {
+    return 1.5/psize;
+  }
+  static inline double value(double d, double psize, const PixonBasis &b)
+  {
+    double r = fabs(d)/psize, s = 1.0 - r, k = norm(psize, b) * (s*s)*(s*s) * (4.0*r + 1);
+    return (r <= 1.0)?k:0.0;
+  }
+};
+
+/* 
+ * kernels of a pixon basis tabulated on integer lags, for the pixon sizes 
+ * (ip+1)/sub_factor, value(ip, m) = basis.function(m, 0, psize of ip).
+ */
+class PixonKernelTable
+{
+  public:
+    PixonKernelTable();
+    ~PixonKernelTable();
+    /* tabulate nsize pixon sizes */
+    void build(int nsize_in, int sub_factor, const PixonBasis &basis);
+    inline double value(int ip, int m) const
+    {
+      m = abs(m);
+      return (m <= hw[ip])?kernel[offset[ip] + m]:0.0;
+    }
+
+    int nsize;      /* number of pixon sizes */
+    int *hw;        /* half widths, kernels vanish beyond */
+    int *offset;    /* offsets of the kernel of each size, on lags 0,...,hw */
+    double *kernel; /* kernels */
+    double *norm;   /* pixon_norm of each size */
+  private:
+    PixonKernelTable(const PixonKernelTable &);
+    PixonKernelTable& operator = (const PixonKernelTable &);
+};
+
+/* 
+ * per-run context of a reconstruction: pixon factors, the pixon basis and its 
+ * tabulated kernels. pixon objects refer to the context of their run, runs with 
+ * their own contexts can go on separate threads. setup and reserve are done before
+ * any pixon is created, the pixons only read the context, so that it can be shared 
+ * by pixons on several threads. the convolution mode of the run is kept here too.
+ */
+class PixonContext
+{
+  public:
+    PixonContext();
+    /* set pixon factors and basis, done once before pixons are set up */
+    void setup(int basis_type, int size_factor, int sub_factor, int map_low_bound);
+    /* tabulate the kernels of at least nsize pixon sizes, the most any pixon uses */
+    void reserve(int nsize);
+    /* set the convolution mode from its name, auto, fft, or direct */
+    void set_conv(string mode);
+
+    int conv_mode;           /* pixon convolution mode, PIXON_CONV */
+    int pixon_size_factor;   /* extension of pixon in term of pixon size */
+    int pixon_sub_factor;    /* sub-resolution of pixon size */
+    int pixon_map_low_bound; /* low bound of pixon size */
+    PixonBasis basis;
+    PixonKernelTable pixon_table;
+};
+
 /* 
  * Data class for light curves.
  */
@@ -156,16 +386,21 @@ class DataFFT
     /* destructor */
     ~DataFFT();
     /* convolution with resp, output to conv */
-    void convolve_simple(double *conv);
+    void convolve_simple(double *conv, double bg = 0.0);
+    void convolve_simple(const fft_complex *spec, double *conv, double bg = 0.0, double scale = 1.0);
     double get_fft_norm(){return fft_norm;}
     void set_resp_real(const double *resp, int nall, int ipositive);
  
   protected:
+    void calibrate_cost();
+
     int nd, npad, nd_fft, nd_fft_cal;
     double fft_norm;
-    fftw_complex *data_fft, *resp_fft, *conv_fft;
-    double *data_real, *resp_real, *conv_real;
-    fftw_plan pdata, presp, pback;
+    double cost_fft, cost_tap; /* cost of one transform and one direct multiply-add */
+    double ops_fft;  /* operation count of one transform in direct multiply-adds */
+    fft_complex *data_fft, *resp_fft, *conv_fft;
+    fft_real *data_real, *resp_real, *conv_real;
+    fft_plan pforward, pbackward; /* shared plans from the registry */
 };
 
 /* 
@@ -179,24 +414,40 @@ class RMFFT:public DataFFT
 {
   public:
     /* default constructor */
-    RMFFT(){}
+    RMFFT();
     /* constructor */
     RMFFT(int n, double dx, int npad_in = 20);
     RMFFT(int n, double *cont, double dx, int npad_in = 20);
     RMFFT(Data& cont, int npad_in = 20);
+    /* workspace on the same grid with the same data, own buffers on the shared plans */
+    RMFFT(const RMFFT& rm);
     /* destructor */
-    ~RMFFT(){}
+    ~RMFFT();
     /* set data using cont */
     void set_data(Data& cont);
     /* set data using array */
     void set_data(double *cont, int n);
+    /* set data to that of rm on the same grid, without a transform */
+    void set_data(const RMFFT& rm);
     /* convolution with resp, output to conv */
     void convolve(const double *resp, int n, double *conv);
     void convolve_bg(const double *resp, int n, double *conv, double bg = 0.0);
     void convolve_bg(const double *resp, int n, int ipositive, double *conv, double bg = 0.0);
+    /* direct convolution in double, reference for the FFT */
+    void convolve_bg_direct(const double *resp, int n, int ipositive, double *conv, double bg = 0.0);
+    /* correlation of g with data, adjoint of convolve_bg with respect to resp */
+    void correlate_data(const double *g, int n, int ipositive, double *corr);
+    /* correlation of g with resp, adjoint of convolve_bg with respect to data */
+    void correlate_resp(const double *g, double *corr);
+    /* direct update of convolve_bg after resp changes at a few pixels */
+    void convolve_update(const int *list, const double *dresp, int nlist, int ipositive, double *conv);
+    bool use_update(int nlist);
 
     friend class Pixon;
+
+    bool reference;   /* convolve_bg with the direct convolution in double */
   private:
+    double *data_ref; /* data in double for the direct convolution */
 };
 
 /* class to do Pixon FFT, inherits DataFFT class */
@@ -204,11 +455,14 @@ class PixonFFT:public DataFFT
 {
   public:
     PixonFFT();
-    PixonFFT(int npixel, int npixon_size_max);
+    PixonFFT(const PixonContext& ctx_in, int npixel, int npixon_size_max);
     ~PixonFFT();
     void convolve(const double *pseudo_img, int *pixon_map, double *conv);
-    void convolve_pixon_diff_low(const double *pseudo_img, int *pixon_map, double *conv);
-    void convolve_pixon_diff_up(const double *pseudo_img, int *pixon_map, double *conv);
+    void convolve_pixon_diff(const double *pseudo_img, int *pixon_map, double *conv_low, double *conv_up);
+    void convolve_transpose(const double *img, int *pixon_map, double *conv);
+    /* convolution at a few pixels, after their pixon sizes changed */
+    void convolve_update(const double *pseudo_img, const int *pixon_map, const int *list, int nlist, double *conv);
+    bool use_update(int nlist);
     /* reduce the minimum pixon size */
     void reduce_pixon_min();
     void increase_pixon_min();
@@ -216,13 +470,40 @@ class PixonFFT:public DataFFT
 
     friend class Pixon;
 
+    const PixonContext *ctx;    /* context of the run */
+    int conv_mode;        /* convolution mode, PIXON_CONV, from the context */
     int npixon_size_max;  /* maximum pixon size, in unit of pixel/pixon_sub_factor */
     int ipixon_min; /* minimum pixon index */
     double *pixon_sizes; /* pixon sizes */
     double *pixon_sizes_num; /* number of pixon at each size */
 
-    double *conv_tmp;
   protected:
+    void update_kernel_cache();
+    bool use_direct(int ip);
+    int set_batch();
+    void transform_image(const double *pseudo_img, int nbatch);
+    void convolve_batch(const fft_complex *kernels, const double *taps_all, const int *hw, 
+                        const int *pixon_map, int nbatch, double *conv);
+
+    int kernel_ipixon_min;  /* minimum pixon index in kernel cache */
+    fft_complex *kernel_fft;  /* normalized kernel spectra of pixon sizes */
+    fft_complex *kernel_fft_low; /* spectra of kernel differences with lower sizes */
+    fft_complex *kernel_fft_up;  /* spectra of kernel differences with upper sizes */
+    double *kernel_norm;  /* kernel normalizations */
+
+    int *batch_ipixon;  /* pixon indices of active sizes in the batch */
+    int *batch_slot;    /* slots of pixon indices in the batch */
+    fft_complex *batch_fft;  /* batch of spectra */
+    fft_real *batch_real;  /* batch of real arrays */
+    const fft_complex **batch_spec_in, **batch_spec_kernel; /* spectra of a batch product sum */
+    double *batch_scale;  /* scales of a batch product sum */
+    fft_plan *pback_batch, *pdata_batch; /* batched plans, indexed by batch size, owned by the registry */
+
+    int tap_hw_max;  /* maximum half width of kernel taps */
+    int *tap_hw, *tap_hw_up; /* half widths of kernels and of upper differences */
+    double *taps, *taps_low, *taps_up; /* normalized kernel taps and taps of differences */
+    double *tap_norm; /* kernel normalizations */
+    double *pad_real; /* zero-padded image for direct convolution */
 };
 
 /* class to do uniform pixon FFT */
@@ -230,9 +511,10 @@ class PixonUniFFT:public DataFFT
 {
   public:
     PixonUniFFT();
-    PixonUniFFT(int npixel, int npixon_size_max);
+    PixonUniFFT(const PixonContext& ctx_in, int npixel, int npixon_size_max);
     ~PixonUniFFT();
     void convolve(const double *pseudo_img, int ipixon, double *conv);
+    void convolve_transpose(const double *img, int ipixon, double *conv);
     /* reduce the minimum pixon size */
     void reduce_pixon_min();
     void increase_pixon_min();
@@ -240,10 +522,89 @@ class PixonUniFFT:public DataFFT
 
     friend class Pixon;
 
+    const PixonContext *ctx;    /* context of the run */
+    int conv_mode;        /* convolution mode, PIXON_CONV, from the context */
     int npixon_size_max;  /* maximum pixon size, in unit of pixel/pixon_sub_factor */
     int ipixon_min; /* minimum pixon index */
     double *pixon_sizes; /* pixon sizes */
   protected:
+    void update_kernel_cache(int ipixon);
+    bool use_direct(int ip);
+
+    int kernel_ipixon_min;  /* minimum pixon index in kernel cache */
+    fft_complex *kernel_fft;  /* normalized kernel spectra of pixon sizes */
+    double *kernel_norm;  /* kernel normalizations */
+
+    int tap_hw_max;  /* maximum half width of kernel taps */
+    int *tap_hw;  /* half widths of kernels */
+    double *taps; /* kernel taps, not normalized */
+    double *tap_norm; /* kernel normalizations */
+    double *pad_real; /* zero-padded image for direct convolution */
+};
+
+/* 
+ * one 64-byte aligned block holding the buffers of a reconstruction object. 
+ * buffers are added with their sizes first, then one allocation hands out padded 
+ * slices to them, zero initialized. the block is freed with the arena.
+ */
+#define ARENA_ALIGN 64
+class Arena
+{
+  public:
+    Arena();
+    ~Arena();
+    /* buffer *ptr of n elements, set by allocate */
+    template<class T> void add(T **ptr, int n)
+    {
+      slices.push_back(ArenaSlice{(void **)ptr, padded(n*sizeof(T))});
+    }
+    void allocate();
+    size_t size(){return nbytes;}
+  private:
+    struct ArenaSlice
+    {
+      void **ptr;
+      size_t nbytes;
+    };
+    static size_t padded(size_t n){return (n + ARENA_ALIGN-1)/ARENA_ALIGN*ARENA_ALIGN;}
+    Arena(const Arena &);
+    Arena& operator = (const Arena &);
+
+    vector<ArenaSlice> slices;
+    char *block;   /* allocated block */
+    char *base;    /* aligned start of block */
+    size_t nbytes; /* size of slices */
+};
+
+/* index of the calling thread in a parallel gradient loop, 0 without OpenMP */
+inline int grad_thread_num()
+{
+#ifdef _OPENMP
+  return omp_get_thread_num();
+#else
+  return 0;
+#endif
+}
+
+/*
+ * per-thread workspaces of the per-pixel gradient loops, each thread has its own 
+ * RM convolution and two scratch arrays. thread 0 works on those of the owner, 
+ * the other threads copy the data of the owner's convolution before the loop.
+ * set up at the first reference gradient, the adjoint gradients do not need them.
+ */
+class GradThreads
+{
+  public:
+    GradThreads();
+    ~GradThreads();
+    /* nthread workspaces for convolution rm, scratch arrays of n points */
+    void setup(RMFFT *rm, double *buf1_in, double *buf2_in, int n, int nthread_in);
+
+    int nthread;
+    RMFFT **rmfft;
+    double **buf1, **buf2;
+  private:
+    Arena arena;
 };
 
 /* class Pixon */
@@ -251,21 +612,34 @@ class Pixon
 {
   public:
     Pixon();
-    Pixon(Data& cont_in, Data& line_in, int npixel_in,  int npixon_size_in, int ipositive_in=0, double sensitivity=1.0);
-    ~Pixon();
-    double interp_image(double t);
-    double interp_line(double t);
-    double interp_cont(double t);
-    double interp_pixon(double t);
+    Pixon(const PixonContext& ctx_in, Data& cont_in, Data& line_in, int npixel_in,  int npixon_size_in, int ipositive_in=0, 
+          double sensitivity=1.0, bool adjoint_grad=true);
+    virtual ~Pixon();
+    /* switch to the reference evaluation with direct convolutions in double, and back */
+    virtual void set_reference(bool ref);
+    void scatter_line(const double *w, double *g);
     void compute_rm_pixon(const double *x);
+    bool update_rm_pixon(const double *x);
+    void rm_store(const double *x);
+    void flag_pixon_map_updated(int ip);
+    double evaluate(const double *x, bool want_grad);
+    bool eval_cached(const double *x, int n, bool want_grad);
+    void eval_store(const double *x, int n, bool want_grad, double f);
     double compute_chisquare(const double *x);
     double compute_mem(const double *x);
     void compute_chisquare_grad(const double *x);
+    void compute_chisquare_grad_ref(const double *x);
+    void compute_chisquare_grad_adjoint(const double *x);
+    void compute_grad_pixon_size(bool low, bool up);
     void compute_chisquare_grad_pixon_low();
     void compute_chisquare_grad_pixon_up();
     void compute_mem_grad(const double *x);
     void compute_mem_grad_pixon_low();
     void compute_mem_grad_pixon_up();
+    void compute_hessian_vector(const double *x, const double *v, double *hv);
+    void perturb_image(const double *v);
+    void perturb_residual();
+    void compute_hessian_vector_image(const double *v, double *hv);
     double compute_pixon_number();
     void reduce_pixon_map_all();
     bool reduce_pixon_map_uniform();
@@ -278,20 +652,26 @@ class Pixon
     Data cont, line;
     RMFFT rmfft;
     PixonFFT pfft;
+    Arena arena;  /* buffers of the reconstruction */
+    GradThreads grad_threads; /* workspaces of the reference chisq gradient */
 
+    const PixonContext *ctx;  /* context of the run */
     int npixel;   /* number of pixels */
     int *pixon_map;   /* pixon map */
-    bool *pixon_map_updated;  /* pixons updated */
+    bool *pixon_map_updated;  /* pixons updated since image was last computed */
     double *image;           /* image */
     double *pseudo_image;    /* pseudo image */
 
     double tau0;    /* lower bound of lags */
     int ipositive;  /* first index of positive lags */
     double sensitivity;
+    bool adjoint_grad;  /* adjoint or reference gradient of chi square */
 
     double dt;          /* time interval of continuum, image grid */
     double chisq;       /* chi square */
     double mem;         /* entropy */
+    double Itot;        /* total flux of image */
+    double mem_alpha;   /* entropy weight, log(pixon number)/log(npixel) */
     double bg;          /* background */
     double *rmline;     /* reverberated line */
     double *itline;     /* interpolation of line to observed epochs */
@@ -304,17 +684,45 @@ class Pixon
     double *grad_mem_pixon_up;
     double *resp_pixon;
     double *conv_pixon;
+    double *conv_pixon_low; /* convolutions with kernel differences to lower sizes */
+    double *conv_pixon_up;  /* convolutions with kernel differences to upper sizes */
+    double *resid_weight; /* weighted residuals */
+    double *resid_cont;  /* weighted residuals scattered onto continuum grid */
+    double *grad_image;  /* chi square gradient with respect to image */
+    double *resid_corr;  /* weighted residuals correlated with continuum shifted by each lag */
+    double *hv_image;    /* perturbation of image along the vector of a hessian product */
+    double *hv_line;     /* perturbation of rmline, then its weighted residuals scattered onto continuum grid */
+    double *hv_resid;    /* perturbation of residuals, weighted */
+    InterpOp interp_line_op; /* interpolation from continuum grid to line epochs */
+    InterpOp interp_lag_op;  /* the same, with line epochs shifted by each lag of image */
+    double *pixon_norms; /* pixon_norm of each pixon size */
+    double pixon_number; /* pixon number, updated with the pixon map */
+
+    /* cache of the last evaluation, invalidated when the model state changes */
+    bool reference;   /* reference evaluation, see set_reference */
+
+    bool eval_valid, eval_grad, eval_reference;
+    int eval_conv_mode;
+    int nx_eval;
+    double *x_eval;
+    double f_eval;
+
+    /* image and rmline of the last compute_rm_pixon, updated incrementally after pixon map changes */
+    bool rm_valid, rm_reference;
+    int rm_conv_mode;
+    int nx_rm;     /* number of parameters image and rmline depend on */
+    double *x_rm;
+    int nmap_updated;       /* number of pixels with pixon sizes changed since then */
+    int *map_updated_list;  /* these pixels */
+    double *dimage_updated; /* changes of image at these pixels */
 
   private:
 };
 
-/* pixon functions */
-typedef double (*PixonFunc)(double x, double y, double psize);
-typedef double (*PixonNorm)(double);
-extern PixonFunc pixon_function;
-extern PixonNorm pixon_norm;
+void report_fft_precision(Pixon& pixon, tnc_function *func, double *x, int n, void *state);
 
 /* functions for nlopt and tnc */
 double func_nlopt(const vector<double> &x, vector<double> &grad, void *f_data);
 int func_tnc(double x[], double *f, double g[], void *state);
+int hessp_tnc(double x[], double v[], double hv[], void *state);
 #endif
\ No newline at end of file